@@ -0,0 +1,258 @@
+// Stress test of multi-key atomicity: writes a directory of jobs that WRITE
+// and READ overlapping sets of keys at the same time, runs kvs over it and
+// checks that no READ saw part of a WRITE.
+//
+// Usage: atomicity [-f files] [-c commands] [-g groups] [-k keys] [-t threads]
+//                  [-s seed] [-x kvs options] <kvs> <jobs dir>
+//
+// Keys come in groups of -k keys ("g<group>k<key>"). Every WRITE sets all the
+// keys of one to three groups to a value of its own, and every READ reads one
+// to three whole groups, so the keys of a group are always equal unless a
+// READ ran in the middle of a WRITE. The groups of a command overlap those of
+// the commands of every other job, which run at the same time with -t
+// threads. Prints the READs checked and the torn ones, and exits with 1 if
+// any READ was torn or kvs failed.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Options passed to kvs with -x, plus its own arguments
+#define MAX_KVS_ARGS 32
+// Groups a command touches at most
+#define MAX_SPAN 3
+
+static uint64_t rng_state;
+
+static uint64_t next_random() {
+  // xorshift64*, as in gen_jobs
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-f files] [-c commands] [-g groups] [-k keys] "
+          "[-t threads] [-s seed] [-x kvs options] <kvs> <jobs dir>\n",
+          name);
+}
+
+// Picks 1 to MAX_SPAN distinct groups.
+// @return Number of groups picked.
+static size_t pick_groups(size_t groups, size_t picked[MAX_SPAN]) {
+  size_t span = 1 + (size_t)(next_random() % MAX_SPAN);
+  if (span > groups)
+    span = groups;
+  size_t count = 0;
+  while (count < span) {
+    size_t group = (size_t)(next_random() % groups);
+    int seen = 0;
+    for (size_t i = 0; i < count; i++) {
+      seen |= picked[i] == group;
+    }
+    if (!seen)
+      picked[count++] = group;
+  }
+  return count;
+}
+
+static int write_job(const char *path, size_t job, size_t commands,
+                     size_t groups, size_t keys) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  for (size_t c = 0; c < commands; c++) {
+    size_t picked[MAX_SPAN];
+    size_t span = pick_groups(groups, picked);
+    int is_write = next_random() % 2 == 0;
+    fputs(is_write ? "WRITE [" : "READ [", file);
+    for (size_t g = 0; g < span; g++) {
+      for (size_t k = 0; k < keys; k++) {
+        if (is_write) {
+          // the value is the same for every key and tells the WRITEs apart
+          fprintf(file, "(g%zuk%zu,j%zuc%zu)", picked[g], k, job, c);
+        } else {
+          fprintf(file, g + k ? ",g%zuk%zu" : "g%zuk%zu", picked[g], k);
+        }
+      }
+    }
+    fputs("]\n", file);
+  }
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+// Checks one line of output: "[(g1k0,v)(g1k1,v)...]". Keys come sorted, so
+// the keys of a group are next to each other.
+// @return 1 if a group has keys with different values, 0 otherwise.
+static int torn_read(const char *line) {
+  char group[64] = "", value[64] = "";
+  const char *pos = line + 1;
+  while (*pos == '(') {
+    char key[64], pair_value[64];
+    int used;
+    if (sscanf(pos, "(%63[^,],%63[^)])%n", key, pair_value, &used) != 2) {
+      break;
+    }
+    pos += used;
+    char *split = strchr(key, 'k');
+    if (split != NULL) {
+      *split = '\0';
+    }
+    if (strcmp(key, group) == 0 && strcmp(pair_value, value) != 0) {
+      return 1;
+    }
+    snprintf(group, sizeof(group), "%s", key);
+    snprintf(value, sizeof(value), "%s", pair_value);
+  }
+  return 0;
+}
+
+// Checks the output of every job of the directory.
+// @param reads Set to the READs checked.
+// @return Number of torn READs.
+static size_t check_outputs(const char *dir_path, size_t *reads) {
+  DIR *dir = opendir(dir_path);
+  if (!dir)
+    return 0;
+  size_t torn = 0;
+  struct dirent *dp;
+  while ((dp = readdir(dir)) != NULL) {
+    size_t len = strlen(dp->d_name);
+    if (len < 4 || strcmp(dp->d_name + len - 4, ".out") != 0)
+      continue;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, dp->d_name);
+    FILE *file = fopen(path, "r");
+    if (!file)
+      continue;
+    char line[8192];
+    while (fgets(line, sizeof(line), file) != NULL) {
+      if (line[0] != '[')
+        continue;
+      (*reads)++;
+      if (torn_read(line)) {
+        if (torn++ == 0) {
+          fprintf(stderr, "Torn READ in %s: %s", dp->d_name, line);
+        }
+      }
+    }
+    fclose(file);
+  }
+  closedir(dir);
+  return torn;
+}
+
+// Runs kvs over the jobs with 1 backup and the given threads.
+// @return 0 if kvs exited with status 0, 1 otherwise.
+static int run_kvs(const char *kvs, char *options, const char *dir,
+                   const char *threads) {
+  char *args[MAX_KVS_ARGS];
+  size_t num_args = 0;
+  args[num_args++] = (char *)kvs;
+  for (char *arg = options ? strtok(options, " ") : NULL;
+       arg != NULL && num_args < MAX_KVS_ARGS - 4; arg = strtok(NULL, " ")) {
+    args[num_args++] = arg;
+  }
+  args[num_args++] = (char *)dir;
+  args[num_args++] = "1";
+  args[num_args++] = (char *)threads;
+  args[num_args] = NULL;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+    return 1;
+  }
+  if (pid == 0) {
+    execv(kvs, args);
+    fprintf(stderr, "Failed to run %s: %s\n", kvs, strerror(errno));
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    fprintf(stderr, "Failed to wait for kvs: %s\n", strerror(errno));
+    return 1;
+  }
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t files = 8, commands = 20000, groups = 16, keys = 4;
+  const char *threads = "8";
+  char *options = NULL;
+  rng_state = 42;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:c:g:k:t:s:x:")) != -1) {
+    switch (opt) {
+    case 'f':
+      files = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      commands = strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      groups = strtoul(optarg, NULL, 10);
+      break;
+    case 'k':
+      keys = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      threads = optarg;
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 10) | 1;
+      break;
+    case 'x':
+      options = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  // a READ of MAX_SPAN groups has to fit kvs' MAX_WRITE_SIZE keys
+  if (argc - optind != 2 || files == 0 || groups == 0 || keys == 0 ||
+      MAX_SPAN * keys > 256) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *kvs = argv[optind];
+  const char *dir = argv[optind + 1];
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  for (size_t f = 0; f < files; f++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/atomic%03zu.job", dir, f);
+    if (write_job(path, f, commands, groups, keys)) {
+      return 1;
+    }
+  }
+
+  int failed = run_kvs(kvs, options, dir, threads);
+  if (failed) {
+    fprintf(stderr, "kvs failed\n");
+  }
+  size_t reads = 0;
+  size_t torn = check_outputs(dir, &reads);
+  printf("reads,torn\n%zu,%zu\n", reads, torn);
+  return failed || torn > 0 || reads == 0;
+}
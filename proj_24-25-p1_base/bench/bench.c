@@ -0,0 +1,304 @@
+// Runs kvs over a job directory for every combination of max backups and
+// max threads, and prints one CSV line per run:
+//
+//   backups,threads,commands,wall_s,ops_per_s,max_rss_kb,avg_util_pct,
+//   thread_util_pct
+//
+// Usage: bench [-b backups,...] [-t threads,...] [-r runs] [-x kvs options]
+//              <kvs> <jobs dir>
+//
+// Outputs and backups of the previous run are removed before each run, and
+// with -r the fastest of the runs of each combination is reported. -x passes
+// options to kvs, e.g. -x -o to run the largest jobs first.
+//
+// Utilization is the share of the run each kvs thread spent on jobs, as kvs
+// -u reports it: thread_util_pct lists every thread's, separated by ';'.
+
+#define _DEFAULT_SOURCE // wait4
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_VALUES 32
+// Options passed to kvs with -x, plus its own arguments
+#define MAX_KVS_ARGS 32
+
+static int has_suffix(const char *name, const char *suffix) {
+  size_t len = strlen(name), suffix_len = strlen(suffix);
+  return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+// Parses "1,2,4" into values.
+// @return Number of values, 0 if the list is invalid.
+static size_t parse_list(const char *list, unsigned values[MAX_VALUES]) {
+  size_t count = 0;
+  while (*list != '\0' && count < MAX_VALUES) {
+    char *end;
+    unsigned long value = strtoul(list, &end, 10);
+    if (end == list || value == 0 || (*end != ',' && *end != '\0'))
+      return 0;
+    values[count++] = (unsigned)value;
+    list = *end == ',' ? end + 1 : end;
+  }
+  return *list == '\0' ? count : 0;
+}
+
+// Counts the commands of every job, so runs can be reported as ops/s.
+static size_t count_commands(const char *dir_path) {
+  DIR *dir = opendir(dir_path);
+  if (!dir)
+    return 0;
+  size_t commands = 0;
+  struct dirent *dp;
+  while ((dp = readdir(dir)) != NULL) {
+    if (!has_suffix(dp->d_name, ".job"))
+      continue;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, dp->d_name);
+    FILE *file = fopen(path, "r");
+    if (!file)
+      continue;
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+      if (line[0] != '\n' && line[0] != '#')
+        commands++;
+    }
+    fclose(file);
+  }
+  closedir(dir);
+  return commands;
+}
+
+// Removes what a previous run left in the job directory.
+static void clean_outputs(const char *dir_path) {
+  DIR *dir = opendir(dir_path);
+  if (!dir)
+    return;
+  struct dirent *dp;
+  while ((dp = readdir(dir)) != NULL) {
+    if (has_suffix(dp->d_name, ".out") || has_suffix(dp->d_name, ".bck") ||
+        has_suffix(dp->d_name, ".snap")) {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s/%s", dir_path, dp->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+// Splits the -x option string on spaces into args.
+// @return Number of options, or -1 if there are too many.
+static int split_options(char *options, char *args[]) {
+  int count = 0;
+  for (char *arg = strtok(options, " "); arg != NULL; arg = strtok(NULL, " ")) {
+    if (count == MAX_KVS_ARGS - 6)
+      return -1;
+    args[count++] = arg;
+  }
+  return count;
+}
+
+// Reads the stderr of kvs up to its exit, keeping the utilization of each
+// thread and passing every other line on.
+static void read_usage(FILE *errors, double *util, unsigned threads) {
+  char line[1024];
+  while (fgets(line, sizeof(line), errors) != NULL) {
+    unsigned thread, jobs;
+    double busy, elapsed, pct;
+    if (sscanf(line, "Thread %u: %u jobs, busy %lf of %lf s (%lf%%)", &thread,
+               &jobs, &busy, &elapsed, &pct) == 5 &&
+        thread < threads) {
+      util[thread] = pct;
+    } else {
+      fputs(line, stderr);
+    }
+  }
+}
+
+// Runs kvs once.
+// @param options Options for kvs given with -x, NULL terminated.
+// @param wall Set to the elapsed time in seconds.
+// @param max_rss Set to the peak resident set of kvs, in KB.
+// @param util Set to the utilization of each of the threads, in percent.
+// @return 0 if kvs exited with status 0, 1 otherwise.
+static int run_once(const char *kvs, char *const options[], const char *dir,
+                    unsigned backups, unsigned threads, double *wall,
+                    long *max_rss, double *util) {
+  char backups_arg[16], threads_arg[16];
+  snprintf(backups_arg, sizeof(backups_arg), "%u", backups);
+  snprintf(threads_arg, sizeof(threads_arg), "%u", threads);
+  char *args[MAX_KVS_ARGS];
+  size_t num_args = 0;
+  args[num_args++] = (char *)kvs;
+  args[num_args++] = "-u";
+  for (size_t i = 0; options[i] != NULL; i++) {
+    args[num_args++] = options[i];
+  }
+  args[num_args++] = (char *)dir;
+  args[num_args++] = backups_arg;
+  args[num_args++] = threads_arg;
+  args[num_args] = NULL;
+
+  int errors[2];
+  if (pipe(errors) != 0) {
+    fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+    return 1;
+  }
+  for (unsigned i = 0; i < threads; i++) {
+    util[i] = 0;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+    close(errors[0]);
+    close(errors[1]);
+    return 1;
+  }
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      close(null_fd);
+    }
+    dup2(errors[1], STDERR_FILENO);
+    close(errors[0]);
+    close(errors[1]);
+    execv(kvs, args);
+    fprintf(stderr, "Failed to run %s: %s\n", kvs, strerror(errno));
+    _exit(127);
+  }
+  close(errors[1]);
+  FILE *error_file = fdopen(errors[0], "r");
+  if (error_file != NULL) {
+    read_usage(error_file, util, threads);
+    fclose(error_file);
+  } else {
+    close(errors[0]);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    fprintf(stderr, "Failed to wait for kvs: %s\n", strerror(errno));
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *wall = (double)(end.tv_sec - start.tv_sec) +
+          (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  *max_rss = usage.ru_maxrss;
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static void usage_error(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-b backups,...] [-t threads,...] [-r runs] "
+          "[-x kvs options] <kvs> <jobs dir>\n",
+          name);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned backups[MAX_VALUES] = {1}, threads[MAX_VALUES] = {1};
+  size_t num_backups = 1, num_threads = 1;
+  unsigned runs = 1;
+  char *options[MAX_KVS_ARGS] = {NULL};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:t:r:x:")) != -1) {
+    switch (opt) {
+    case 'b':
+      num_backups = parse_list(optarg, backups);
+      break;
+    case 't':
+      num_threads = parse_list(optarg, threads);
+      break;
+    case 'r':
+      runs = (unsigned)strtoul(optarg, NULL, 10);
+      break;
+    case 'x':
+      if (split_options(optarg, options) < 0) {
+        usage_error(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage_error(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || num_backups == 0 || num_threads == 0 ||
+      runs == 0) {
+    usage_error(argv[0]);
+    return 1;
+  }
+  const char *kvs = argv[optind];
+  const char *dir = argv[optind + 1];
+
+  size_t commands = count_commands(dir);
+  if (commands == 0) {
+    fprintf(stderr, "No commands found in %s\n", dir);
+    return 1;
+  }
+
+  printf("backups,threads,commands,wall_s,ops_per_s,max_rss_kb,avg_util_pct,"
+         "thread_util_pct\n");
+  fflush(stdout);
+  int result = 0;
+  for (size_t b = 0; b < num_backups; b++) {
+    for (size_t t = 0; t < num_threads; t++) {
+      double *util = malloc(2 * threads[t] * sizeof(double));
+      if (!util) {
+        fprintf(stderr, "Failed to allocate utilization\n");
+        return 1;
+      }
+      double *best_util = util + threads[t];
+      double best = -1;
+      long best_rss = 0;
+      for (unsigned r = 0; r < runs; r++) {
+        double wall;
+        long max_rss;
+        clean_outputs(dir);
+        if (run_once(kvs, options, dir, backups[b], threads[t], &wall,
+                     &max_rss, util)) {
+          fprintf(stderr, "kvs failed with %u backups, %u threads\n",
+                  backups[b], threads[t]);
+          result = 1;
+          continue;
+        }
+        if (best < 0 || wall < best) {
+          best = wall;
+          best_rss = max_rss;
+          memcpy(best_util, util, threads[t] * sizeof(double));
+        }
+      }
+      if (best >= 0) {
+        double util_sum = 0;
+        for (unsigned i = 0; i < threads[t]; i++) {
+          util_sum += best_util[i];
+        }
+        printf("%u,%u,%zu,%.3f,%.0f,%ld,%.1f,", backups[b], threads[t],
+               commands, best, (double)commands / best, best_rss,
+               util_sum / threads[t]);
+        for (unsigned i = 0; i < threads[t]; i++) {
+          printf(i ? ";%.1f" : "%.1f", best_util[i]);
+        }
+        printf("\n");
+        fflush(stdout);
+      }
+      free(util);
+    }
+  }
+  clean_outputs(dir);
+  return result;
+}
@@ -0,0 +1,203 @@
+// Generates a directory of synthetic .job files for benchmarking kvs.
+//
+// Usage: gen_jobs [-f files] [-c commands] [-k keys] [-z skew] [-p pairs]
+//                 [-m write,read,delete,backup] [-l factor] [-s seed]
+//                 <jobs dir>
+//
+// Keys are drawn from "k0".."k<keys-1>", uniformly for skew 0 or from a
+// zipfian distribution with that exponent otherwise. Each command carries
+// between 1 and pairs keys, and the mix gives the relative weight of each
+// command type. With -l the last file has factor times the commands, a
+// straggler for testing how jobs are scheduled.
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../constants.h"
+
+enum { MIX_WRITE, MIX_READ, MIX_DELETE, MIX_BACKUP, MIX_KINDS };
+
+static uint64_t rng_state;
+
+static uint64_t next_random() {
+  // xorshift64*, plenty for picking keys
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform double in [0, 1).
+static double next_unit() {
+  return (double)(next_random() >> 11) / (double)(1ULL << 53);
+}
+
+// Cumulative probabilities of each key, NULL for a uniform pick.
+static double *zipf_cdf = NULL;
+static size_t num_keys = 1000;
+
+static int build_zipf(double skew) {
+  zipf_cdf = malloc(num_keys * sizeof(double));
+  if (!zipf_cdf)
+    return 1;
+  double sum = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    sum += 1.0 / pow((double)(i + 1), skew);
+    zipf_cdf[i] = sum;
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    zipf_cdf[i] /= sum;
+  }
+  return 0;
+}
+
+static size_t pick_key() {
+  if (zipf_cdf == NULL) {
+    return (size_t)(next_random() % num_keys);
+  }
+  double u = next_unit();
+  size_t low = 0, high = num_keys - 1;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (zipf_cdf[mid] < u) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-f files] [-c commands] [-k keys] [-z skew] [-p pairs] "
+          "[-m write,read,delete,backup] [-l factor] [-s seed] <jobs dir>\n",
+          name);
+}
+
+static int write_job(const char *path, size_t commands, size_t max_pairs,
+                     const unsigned mix[MIX_KINDS]) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  unsigned total = 0;
+  for (int i = 0; i < MIX_KINDS; i++) {
+    total += mix[i];
+  }
+  for (size_t c = 0; c < commands; c++) {
+    unsigned roll = (unsigned)(next_random() % total);
+    int kind = 0;
+    while (roll >= mix[kind]) {
+      roll -= mix[kind++];
+    }
+    size_t pairs = 1 + (size_t)(next_random() % max_pairs);
+
+    switch (kind) {
+    case MIX_WRITE:
+      fputs("WRITE [", file);
+      for (size_t i = 0; i < pairs; i++) {
+        fprintf(file, "(k%zu,v%llu)", pick_key(),
+                (unsigned long long)(next_random() % 1000000));
+      }
+      fputs("]\n", file);
+      break;
+    case MIX_READ:
+    case MIX_DELETE:
+      fputs(kind == MIX_READ ? "READ [" : "DELETE [", file);
+      for (size_t i = 0; i < pairs; i++) {
+        fprintf(file, i ? ",k%zu" : "k%zu", pick_key());
+      }
+      fputs("]\n", file);
+      break;
+    default:
+      fputs("BACKUP\n", file);
+      break;
+    }
+  }
+
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t files = 8, commands = 100000, max_pairs = 4, long_factor = 1;
+  double skew = 0;
+  unsigned mix[MIX_KINDS] = {20, 75, 4, 1};
+  rng_state = 42;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:c:k:z:p:m:l:s:")) != -1) {
+    switch (opt) {
+    case 'f':
+      files = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      commands = strtoul(optarg, NULL, 10);
+      break;
+    case 'k':
+      num_keys = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      skew = strtod(optarg, NULL);
+      break;
+    case 'p':
+      max_pairs = strtoul(optarg, NULL, 10);
+      break;
+    case 'm':
+      if (sscanf(optarg, "%u,%u,%u,%u", &mix[MIX_WRITE], &mix[MIX_READ],
+                 &mix[MIX_DELETE], &mix[MIX_BACKUP]) != MIX_KINDS) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'l':
+      long_factor = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 10) | 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  // kvs rejects commands with more than MAX_WRITE_SIZE pairs
+  if (argc - optind != 1 || num_keys == 0 || max_pairs == 0 ||
+      max_pairs > MAX_WRITE_SIZE || long_factor == 0 ||
+      mix[0] + mix[1] + mix[2] + mix[3] == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *dir = argv[optind];
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  if (skew > 0 && build_zipf(skew)) {
+    fprintf(stderr, "Failed to allocate key distribution\n");
+    return 1;
+  }
+
+  int result = 0;
+  for (size_t f = 0; f < files && result == 0; f++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench%03zu.job", dir, f);
+    size_t job_commands = f + 1 == files ? commands * long_factor : commands;
+    result = write_job(path, job_commands, max_pairs, mix);
+  }
+  free(zipf_cdf);
+  return result;
+}
@@ -1,3 +1,9 @@
+#ifndef KVS_CONSTANTS_H
+#define KVS_CONSTANTS_H
+
 #define MAX_WRITE_SIZE 256
 #define MAX_STRING_SIZE 40
 #define MAX_JOB_FILE_NAME_SIZE 256
+#define READ_BUFFER_SIZE 65536
+
+#endif // KVS_CONSTANTS_H
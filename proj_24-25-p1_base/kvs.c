@@ -1,115 +1,1028 @@
 #include "kvs.h"
+#include "stats.h"
 #include "string.h"
 
-#include <ctype.h>
 #include <stdlib.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
+#define HASH_SEED 0x9e3779b97f4a7c15ULL
+
+// Seeded 64-bit FNV-1a with a murmur3 finalizer so that keys differing only
+// in their last bytes still spread over the low bits used as bucket index.
+// @param key Any NUL terminated string.
+// @param seed Table seed.
 // @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of
-// the project
+static uint64_t hash(const char *key, uint64_t seed) {
+  uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+  for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+    h ^= *p;
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Free nodes owned by the calling thread. Like the parser's read buffer, the
+// cache is rebound when the thread starts using a different pool.
+struct node_cache {
+  NodePool *pool;
+  KeyNode *free_nodes;
+  size_t count;
+};
+
+static _Thread_local struct node_cache cache = {.pool = NULL};
+
+// Moves up to NODE_CACHE_BATCH nodes from the pool to the thread's cache,
+// carving a new slab when the pool has nothing to give back.
+static void refill_cache(NodePool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (cache.count < NODE_CACHE_BATCH) {
+    KeyNode *keyNode = pool->free_nodes;
+    if (keyNode != NULL) {
+      pool->free_nodes = keyNode->next;
+    } else {
+      if (pool->slabs == NULL || pool->slab_used == SLAB_NODES) {
+        Slab *slab = malloc(sizeof(Slab));
+        if (!slab)
+          break;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_used = 0;
+      }
+      keyNode = &pool->slabs->nodes[pool->slab_used++];
+    }
+    keyNode->next = cache.free_nodes;
+    cache.free_nodes = keyNode;
+    cache.count++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void bind_cache(NodePool *pool) {
+  if (cache.pool != pool) {
+    cache.pool = pool;
+    cache.free_nodes = NULL;
+    cache.count = 0;
+  }
+}
+
+static KeyNode *alloc_node(HashTable *ht) {
+  bind_cache(&ht->pool);
+  if (cache.free_nodes == NULL) {
+    refill_cache(&ht->pool);
+    if (cache.free_nodes == NULL)
+      return NULL;
+  }
+  KeyNode *keyNode = cache.free_nodes;
+  cache.free_nodes = keyNode->next;
+  cache.count--;
+  return keyNode;
+}
+
+static void free_node(HashTable *ht, KeyNode *keyNode) {
+  bind_cache(&ht->pool);
+  keyNode->next = cache.free_nodes;
+  cache.free_nodes = keyNode;
+  cache.count++;
+
+  // hand a batch back so nodes freed by one thread can be reused by others
+  if (cache.count >= 2 * NODE_CACHE_BATCH) {
+    pthread_mutex_lock(&ht->pool.lock);
+    while (cache.count > NODE_CACHE_BATCH) {
+      keyNode = cache.free_nodes;
+      cache.free_nodes = keyNode->next;
+      keyNode->next = ht->pool.free_nodes;
+      ht->pool.free_nodes = keyNode;
+      cache.count--;
+    }
+    pthread_mutex_unlock(&ht->pool.lock);
+  }
+}
+
+// Copies a string into node storage, truncating it to fit.
+static void copy_string(char *dest, const char *src) {
+  size_t len = strnlen(src, MAX_STRING_SIZE - 1);
+  memcpy(dest, src, len);
+  dest[len] = '\0';
+}
+
+static size_t bucket_of(uint64_t h, size_t size) {
+  return (size_t)(h & (size - 1));
+}
+
+static size_t stripe_of(uint64_t h) {
+  return (size_t)(h & (LOCK_STRIPES - 1));
+}
+
+static Buckets *alloc_buckets(size_t size) {
+  Buckets *buckets =
+      calloc(1, sizeof(Buckets) + size * sizeof(_Atomic(KeyNode *)));
+  if (buckets)
+    buckets->size = size;
+  return buckets;
+}
+
+// The epoch record of the calling thread for a table, registered on first
+// use. Records are only freed with the table.
+static _Thread_local struct {
+  HashTable *ht;
+  EpochRecord *record;
+} reader = {.ht = NULL};
+
+static EpochRecord *reader_record(HashTable *ht) {
+  if (reader.ht == ht) {
+    return reader.record;
+  }
+  EpochRecord *record = aligned_alloc(64, sizeof(EpochRecord));
+  if (!record)
+    return NULL;
+  atomic_init(&record->epoch, 0);
+  record->next = atomic_load(&ht->readers);
+  while (!atomic_compare_exchange_weak(&ht->readers, &record->next, record)) {
+  }
+  reader.ht = ht;
+  reader.record = record;
+  return record;
+}
+
+// Moves the epoch forward if every thread inside a read has seen the current
+// one.
+static uint64_t advance_epoch(HashTable *ht) {
+  uint64_t epoch = atomic_load(&ht->epoch);
+  for (EpochRecord *r = atomic_load(&ht->readers); r != NULL; r = r->next) {
+    uint64_t seen = atomic_load(&r->epoch);
+    if (seen != 0 && seen != epoch) {
+      return epoch;
+    }
+  }
+  if (atomic_compare_exchange_strong(&ht->epoch, &epoch, epoch + 1)) {
+    epoch++;
+  }
+  return epoch;
+}
+
+// Frees the nodes of a stripe retired at least two epochs ago. They are kept
+// in retire order, so those form a prefix.
+static void reclaim_nodes(HashTable *ht, Stripe *s) {
+  uint64_t epoch = advance_epoch(ht);
+  size_t done = 0;
+  while (done < s->retired_count && s->retired[done].epoch + 2 <= epoch) {
+    free_node(ht, s->retired[done++].node);
+  }
+  if (done > 0) {
+    memmove(s->retired, s->retired + done,
+            (s->retired_count - done) * sizeof(RetiredNode));
+    s->retired_count -= done;
+  }
+}
+
+// Gives back a node unlinked from a chain of the stripe the caller holds
+// exclusively, once lock-free readers can no longer be on it.
+static void retire_node(HashTable *ht, uint64_t h, KeyNode *keyNode) {
+  Stripe *s = &ht->stripes[stripe_of(h)];
+  if (s->retired_count == s->retired_capacity) {
+    reclaim_nodes(ht, s);
+  }
+  if (s->retired_count == s->retired_capacity) {
+    size_t capacity = s->retired_capacity ? s->retired_capacity * 2 : RETIRE_BATCH;
+    RetiredNode *retired = realloc(s->retired, capacity * sizeof(RetiredNode));
+    if (!retired)
+      return; // leaked into its slab until the table is freed
+    s->retired = retired;
+    s->retired_capacity = capacity;
+  }
+  s->retired[s->retired_count].node = keyNode;
+  s->retired[s->retired_count++].epoch = atomic_load(&ht->epoch);
+}
+
+// Frees replaced bucket arrays no reader can still be walking. With all to
+// free them regardless. The caller holds resize_lock exclusively.
+static void reclaim_buckets(HashTable *ht, int all) {
+  uint64_t epoch = advance_epoch(ht);
+  Buckets **link = &ht->retired_buckets;
+  while (*link != NULL) {
+    Buckets *buckets = *link;
+    if (all || buckets->retired_epoch + 2 <= epoch) {
+      *link = buckets->retired_next;
+      free(buckets);
+    } else {
+      link = &buckets->retired_next;
+    }
+  }
+}
+
+// Copies the pairs of a stripe into a view that still needs them. The caller
+// holds the stripe, exclusively or as the view's only reader.
+static void capture_stripe(HashTable *ht, TableView *view, size_t stripe) {
+  Buckets *arrays[2] = {ht->old_table, ht->table};
+  size_t count = 0;
+  for (int t = 0; t < 2; t++) {
+    for (size_t i = stripe; arrays[t] != NULL && i < arrays[t]->size;
+         i += LOCK_STRIPES) {
+      for (KeyNode *keyNode = arrays[t]->heads[i]; keyNode != NULL;
+           keyNode = keyNode->next) {
+        count++;
+      }
+    }
+  }
+
+  KeyNode *copies = malloc(count * sizeof(KeyNode) + 1);
+  size_t *positions = malloc(count * sizeof(size_t) + 1);
+  if (!copies || !positions) {
+    atomic_store(&view->failed, 1);
+    free(copies);
+    free(positions);
+    copies = NULL;
+    positions = NULL;
+    count = 0;
+  }
+  // numbered as visit_buckets walks them: the old array, then the new one
+  size_t old_size = arrays[0] != NULL ? arrays[0]->size : 0;
+  size_t n = 0;
+  for (int t = 0; t < 2 && copies != NULL; t++) {
+    for (size_t i = stripe; arrays[t] != NULL && i < arrays[t]->size;
+         i += LOCK_STRIPES) {
+      for (KeyNode *keyNode = arrays[t]->heads[i]; keyNode != NULL;
+           keyNode = keyNode->next, n++) {
+        positions[n] = t == 0 ? i : old_size + i;
+        memcpy(copies[n].key, keyNode->key, MAX_STRING_SIZE);
+        memcpy(copies[n].value, keyNode->value, MAX_STRING_SIZE);
+        copies[n].hash = keyNode->hash;
+        copies[n].version = keyNode->version;
+        atomic_init(&copies[n].next, NULL);
+      }
+    }
+  }
+  view->copies[stripe] = copies;
+  view->positions[stripe] = positions;
+  view->copy_counts[stripe] = count;
+  atomic_store(&view->pending[stripe], 0);
+}
 
+// Moves every node of an old bucket to the current table. Sizes are powers of
+// two, so each node lands either in the same index or index + old size. A
+// reader walking the bucket meanwhile may be carried into the new chain; the
+// stripe's seq tells it to retry.
+static void migrate_bucket(HashTable *ht, size_t index) {
+  Buckets *table = ht->table;
+  Buckets *old_table = ht->old_table;
+  KeyNode *keyNode = old_table->heads[index];
+  while (keyNode != NULL) {
+    KeyNode *next = keyNode->next;
+    size_t new_index = bucket_of(keyNode->hash, table->size);
+    keyNode->next = table->heads[new_index];
+    table->heads[new_index] = keyNode;
+    keyNode = next;
+  }
+  old_table->heads[index] = NULL;
+}
+
+// Moves a few more old buckets of a stripe. The caller holds that stripe
+// exclusively; once the stripe has nothing left to move it is counted, and the
+// next unlock retires the old array when every stripe is done.
+static void migrate_step(HashTable *ht, size_t stripe) {
+  Stripe *s = &ht->stripes[stripe];
+  size_t old_size = ht->old_table->size;
+  for (int i = 0; i < MIGRATE_STEP && s->migrate_pos < old_size; i++) {
+    migrate_bucket(ht, s->migrate_pos);
+    s->migrate_pos += LOCK_STRIPES;
+  }
+  if (s->migrate_pos >= old_size && s->migrate_pos != SIZE_MAX) {
+    s->migrate_pos = SIZE_MAX;
+    atomic_fetch_add(&ht->stripes_migrated, 1);
+  }
+}
 
-int hash(const char *key) {
-  int firstLetter = tolower(key[0]);
-  if (firstLetter >= 'a' && firstLetter <= 'z') {
-    return firstLetter - 'a';
-  } else if (firstLetter >= '0' && firstLetter <= '9') {
-    return firstLetter - '0';
+// Returns whether the bucket arrays need to be swapped or freed: a resize has
+// been fully migrated, or the table outgrew its buckets again. The caller
+// holds resize_lock.
+static int resize_due(HashTable *ht) {
+  if (ht->old_table != NULL &&
+      atomic_load(&ht->stripes_migrated) == LOCK_STRIPES) {
+    return 1;
   }
-  return -1; // Invalid index for non-alphabetic or number strings
+  return atomic_load(&ht->count) > ht->table->size * MAX_LOAD_FACTOR;
+}
+
+// Drops a finished resize and starts a new one if the table is still too
+// loaded. Old buckets left behind by stripes that saw no writes are moved
+// here. The caller holds resize_lock exclusively, so no stripe is in use.
+static void resize(HashTable *ht) {
+  // open views keep the bucket order they were opened with
+  for (TableView *view = ht->views; view != NULL; view = view->next) {
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+      if (atomic_load(&view->pending[i])) {
+        capture_stripe(ht, view, i);
+      }
+    }
+  }
+  Buckets *old_table = ht->old_table;
+  if (old_table != NULL) {
+    for (size_t i = 0; i < old_table->size; i++) {
+      migrate_bucket(ht, i);
+    }
+    ht->old_table = NULL;
+    old_table->retired_epoch = atomic_load(&ht->epoch);
+    old_table->retired_next = ht->retired_buckets;
+    ht->retired_buckets = old_table;
+  }
+  reclaim_buckets(ht, 0);
+  if (atomic_load(&ht->count) <= ht->table->size * MAX_LOAD_FACTOR) {
+    return;
+  }
+
+  // The rehash itself is spread over the next writes by migrate_step.
+  Buckets *new_table = alloc_buckets(ht->table->size * 2);
+  if (!new_table)
+    return; // keep working with longer chains
+  ht->old_table = ht->table;
+  ht->table = new_table;
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    ht->stripes[i].migrate_pos = i;
+  }
+  atomic_store(&ht->stripes_migrated, 0);
+}
+
+// Makes sure the key's chain is complete in the current table and advances a
+// pending resize. Must be called before modifying the table.
+static void prepare_write(HashTable *ht, uint64_t h) {
+  Buckets *old_table = ht->old_table;
+  if (old_table != NULL) {
+    migrate_bucket(ht, bucket_of(h, old_table->size));
+    migrate_step(ht, stripe_of(h));
+  }
+}
+
+// Looks for the key in a chain.
+// @param link Set to the pointer that links the node, if not NULL.
+static KeyNode *find_in(_Atomic(KeyNode *) *head, const char *key, uint64_t h,
+                        _Atomic(KeyNode *) **link) {
+  for (KeyNode *keyNode = *head; keyNode != NULL; keyNode = *head) {
+    if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+      if (link)
+        *link = head;
+      return keyNode;
+    }
+    head = &keyNode->next;
+  }
+  return NULL;
+}
+
+// Looks for the key in the current table and, if a resize is running, in the
+// old bucket it would come from.
+static KeyNode *find_node(HashTable *ht, const char *key, uint64_t h) {
+  Buckets *table = ht->table;
+  Buckets *old_table = ht->old_table;
+  KeyNode *keyNode =
+      find_in(&table->heads[bucket_of(h, table->size)], key, h, NULL);
+  if (keyNode == NULL && old_table != NULL) {
+    keyNode =
+        find_in(&old_table->heads[bucket_of(h, old_table->size)], key, h, NULL);
+  }
+  return keyNode;
 }
 
 struct HashTable *create_hash_table() {
-  HashTable *ht = malloc(sizeof(HashTable));
+  HashTable *ht = aligned_alloc(64, sizeof(HashTable));
   if (!ht)
     return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    ht->table[i] = NULL;
+  Buckets *table = alloc_buckets(TABLE_SIZE);
+  if (!table) {
+    free(ht);
+    return NULL;
+  }
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    if (skiplist_init(&ht->stripes[i].order)) {
+      while (i-- > 0) {
+        skiplist_destroy(&ht->stripes[i].order);
+      }
+      free(table);
+      free(ht);
+      return NULL;
+    }
+  }
+  atomic_init(&ht->table, table);
+  atomic_init(&ht->old_table, NULL);
+  atomic_init(&ht->stripes_migrated, 0);
+  atomic_init(&ht->count, 0);
+  ht->seed = HASH_SEED;
+  pthread_rwlock_init(&ht->resize_lock, NULL);
+  atomic_init(&ht->resize_seq, 0);
+  ht->retired_buckets = NULL;
+  atomic_init(&ht->epoch, 1);
+  atomic_init(&ht->readers, NULL);
+  ht->views = NULL;
+  pthread_mutex_init(&ht->views_lock, NULL);
+  pthread_mutex_init(&ht->pool.lock, NULL);
+  ht->pool.slabs = NULL;
+  ht->pool.slab_used = 0;
+  ht->pool.free_nodes = NULL;
+  atomic_init(&ht->version, 0);
+  pthread_mutex_init(&ht->deleted.lock, NULL);
+  ht->deleted.enabled = 0;
+  ht->deleted.entries = NULL;
+  ht->deleted.count = 0;
+  ht->deleted.capacity = 0;
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    pthread_rwlock_init(&ht->stripes[i].lock, NULL);
+    atomic_init(&ht->stripes[i].seq, 0);
+    ht->stripes[i].migrate_pos = SIZE_MAX;
+    ht->stripes[i].retired = NULL;
+    ht->stripes[i].retired_count = 0;
+    ht->stripes[i].retired_capacity = 0;
   }
   return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-  int index = hash(key);
-  KeyNode *keyNode = ht->table[index];
+// Drops the shared hold on resize_lock taken with the stripes, then swaps the
+// bucket arrays if a resize became due. Called with no stripe held.
+static void release_resize_lock(HashTable *ht) {
+  int due = resize_due(ht);
+  pthread_rwlock_unlock(&ht->resize_lock);
 
-  // Search for the key node
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      free(keyNode->value);
-      keyNode->value = strdup(value);
-      return 0;
+  if (due) {
+    STATS_LOCK(STAT_LOCK_RESIZE, pthread_rwlock_trywrlock(&ht->resize_lock),
+               pthread_rwlock_wrlock(&ht->resize_lock));
+    if (resize_due(ht)) {
+      STATS_HOLD_BEGIN(STAT_LOCK_RESIZE);
+      atomic_fetch_add(&ht->resize_seq, 1);
+      resize(ht);
+      atomic_fetch_add_explicit(&ht->resize_seq, 1, memory_order_release);
+      STATS_HOLD_END(STAT_LOCK_RESIZE);
     }
-    keyNode = keyNode->next; // Move to the next node
+    pthread_rwlock_unlock(&ht->resize_lock);
+  }
+}
+
+int reserve_table(HashTable *ht, size_t count) {
+  Buckets *table = ht->table;
+  Buckets *old_table = ht->old_table;
+  size_t total = atomic_load(&ht->count) + count;
+  size_t new_size = table->size;
+  while (total > new_size * MAX_LOAD_FACTOR) {
+    new_size *= 2;
   }
 
-  // Key not found, create a new key node
-  keyNode = malloc(sizeof(KeyNode));
-  keyNode->key = strdup(key);       // Allocate memory for the key
-  keyNode->value = strdup(value);   // Allocate memory for the value
-  keyNode->next = ht->table[index]; // Link to existing nodes
-  ht->table[index] = keyNode; // Place new key node at the start of the list
+  Buckets *new_table = table;
+  if (new_size != table->size) {
+    new_table = alloc_buckets(new_size);
+    if (!new_table)
+      return 1;
+  }
+  // move everything, including a pending resize, in one go
+  Buckets *old[2] = {old_table, table};
+  if (new_table != table || old_table != NULL) {
+    for (int t = 0; t < 2; t++) {
+      for (size_t i = 0; old[t] != NULL && i < old[t]->size; i++) {
+        KeyNode *keyNode = old[t]->heads[i];
+        old[t]->heads[i] = NULL;
+        while (keyNode != NULL) {
+          KeyNode *next = keyNode->next;
+          size_t index = bucket_of(keyNode->hash, new_size);
+          keyNode->next = new_table->heads[index];
+          new_table->heads[index] = keyNode;
+          keyNode = next;
+        }
+      }
+    }
+  }
+  // nobody else uses the table yet, so there are no readers to wait for
+  free(old_table);
+  if (new_table != table) {
+    free(table);
+  }
+  ht->old_table = NULL;
+  ht->table = new_table;
   return 0;
 }
 
-char *read_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
-  KeyNode *keyNode = ht->table[index];
-  char *value;
+// Shared hold on resize_lock taken by every locked operation.
+static void lock_resize_shared(HashTable *ht) {
+  STATS_LOCK(STAT_LOCK_RESIZE, pthread_rwlock_tryrdlock(&ht->resize_lock),
+             pthread_rwlock_rdlock(&ht->resize_lock));
+}
 
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      value = strdup(keyNode->value);
-      return value; // Return copy of the value if found
+static void lock_stripe(HashTable *ht, size_t stripe, int exclusive) {
+  Stripe *s = &ht->stripes[stripe];
+  if (exclusive) {
+    STATS_LOCK(STAT_LOCK_STRIPE, pthread_rwlock_trywrlock(&s->lock),
+               pthread_rwlock_wrlock(&s->lock));
+    atomic_fetch_add(&s->seq, 1);
+    // keep what open views still have to see before it changes
+    for (TableView *view = ht->views; view != NULL; view = view->next) {
+      if (atomic_load_explicit(&view->pending[stripe], memory_order_relaxed)) {
+        capture_stripe(ht, view, stripe);
+      }
     }
-    keyNode = keyNode->next; // Move to the next node
+  } else {
+    STATS_LOCK(STAT_LOCK_STRIPE, pthread_rwlock_tryrdlock(&s->lock),
+               pthread_rwlock_rdlock(&s->lock));
   }
-  return NULL; // Key not found
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
-  KeyNode *keyNode = ht->table[index];
-  KeyNode *prevNode = NULL;
+static void unlock_stripe(HashTable *ht, size_t stripe) {
+  Stripe *s = &ht->stripes[stripe];
+  // only a writer leaves seq odd, and nobody else holds the stripe then
+  if (atomic_load_explicit(&s->seq, memory_order_relaxed) & 1) {
+    atomic_fetch_add_explicit(&s->seq, 1, memory_order_release);
+  }
+  pthread_rwlock_unlock(&s->lock);
+}
 
-  // Search for the key node
-  while (keyNode != NULL) {
-    if (strcmp(keyNode->key, key) == 0) {
-      // Key found; delete this node
-      if (prevNode == NULL) {
-        // Node to delete is the first node in the list
-        ht->table[index] =
-            keyNode->next; // Update the table to point to the next node
+void lock_key(HashTable *ht, const char *key, int exclusive) {
+  lock_resize_shared(ht);
+  lock_stripe(ht, stripe_of(hash(key, ht->seed)), exclusive);
+  STATS_HOLD_BEGIN(STAT_LOCK_STRIPE);
+}
+
+void unlock_key(HashTable *ht, const char *key) {
+  STATS_HOLD_END(STAT_LOCK_STRIPE);
+  unlock_stripe(ht, stripe_of(hash(key, ht->seed)));
+  release_resize_lock(ht);
+}
+
+void stripe_set_add(HashTable *ht, StripeSet *set, const char *key) {
+  size_t stripe = stripe_of(hash(key, ht->seed));
+  set->bits[stripe / 64] |= 1ULL << (stripe % 64);
+}
+
+static int stripe_set_has(const StripeSet *set, size_t stripe) {
+  return (set->bits[stripe / 64] >> (stripe % 64)) & 1;
+}
+
+void lock_stripes(HashTable *ht, const StripeSet *set, int exclusive) {
+  lock_resize_shared(ht);
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    if (stripe_set_has(set, i)) {
+      lock_stripe(ht, i, exclusive);
+    }
+  }
+  STATS_HOLD_BEGIN(STAT_LOCK_STRIPE);
+}
+
+void unlock_stripes(HashTable *ht, const StripeSet *set) {
+  STATS_HOLD_END(STAT_LOCK_STRIPE);
+  for (size_t i = LOCK_STRIPES; i > 0; i--) {
+    if (stripe_set_has(set, i - 1)) {
+      unlock_stripe(ht, i - 1);
+    }
+  }
+  release_resize_lock(ht);
+}
+
+void lock_table(HashTable *ht, int exclusive) {
+  lock_resize_shared(ht);
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    lock_stripe(ht, i, exclusive);
+  }
+  STATS_HOLD_BEGIN(STAT_LOCK_STRIPE);
+}
+
+void unlock_table(HashTable *ht) {
+  STATS_HOLD_END(STAT_LOCK_STRIPE);
+  for (size_t i = LOCK_STRIPES; i > 0; i--) {
+    unlock_stripe(ht, i - 1);
+  }
+  release_resize_lock(ht);
+}
+
+// Readers never block writers: they note the seq of each stripe and of the
+// resize, walk the chains, and check nothing moved on. Announcing the epoch
+// keeps whatever they reach from being freed under them.
+void read_begin(HashTable *ht, const StripeSet *set, ReadGuard *guard) {
+  EpochRecord *record = NULL;
+  if (guard->attempts < READ_RETRIES) {
+    record = reader_record(ht);
+  }
+  if (record == NULL) {
+    lock_stripes(ht, set, 0);
+    guard->locked = 1;
+    return;
+  }
+
+  uint64_t epoch;
+  do {
+    epoch = atomic_load(&ht->epoch);
+    atomic_store(&record->epoch, epoch);
+  } while (atomic_load(&ht->epoch) != epoch);
+
+  guard->resize_seq = atomic_load_explicit(&ht->resize_seq, memory_order_acquire);
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    if (stripe_set_has(set, i)) {
+      guard->seqs[i] =
+          atomic_load_explicit(&ht->stripes[i].seq, memory_order_acquire);
+    }
+  }
+}
+
+int read_end(HashTable *ht, const StripeSet *set, ReadGuard *guard) {
+  if (guard->locked) {
+    unlock_stripes(ht, set);
+    return 0;
+  }
+
+  atomic_thread_fence(memory_order_acquire);
+  int changed = (guard->resize_seq & 1) ||
+                atomic_load_explicit(&ht->resize_seq, memory_order_relaxed) !=
+                    guard->resize_seq;
+  for (size_t i = 0; i < LOCK_STRIPES && !changed; i++) {
+    if (stripe_set_has(set, i)) {
+      changed = (guard->seqs[i] & 1) ||
+                atomic_load_explicit(&ht->stripes[i].seq,
+                                     memory_order_relaxed) != guard->seqs[i];
+    }
+  }
+  atomic_store(&reader.record->epoch, 0);
+  guard->attempts++;
+  return changed;
+}
+
+static void visit_chain(KeyNode *keyNode, pair_visitor visit, void *arg) {
+  for (; keyNode != NULL; keyNode = keyNode->next) {
+    visit(keyNode, arg);
+  }
+}
+
+// Moves heap[i] down until it is no larger than its children.
+static void sift_down(const SkipNode **heap, size_t count, size_t i) {
+  for (;;) {
+    size_t smallest = i;
+    for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < count;
+         child++) {
+      if (strcmp(heap[child]->key, heap[smallest]->key) < 0) {
+        smallest = child;
+      }
+    }
+    if (smallest == i)
+      return;
+    const SkipNode *swap = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = swap;
+    i = smallest;
+  }
+}
+
+void visit_range(HashTable *ht, const char *from, const char *to,
+                 pair_visitor visit, void *arg) {
+  // Every stripe keeps its own keys in order; merge them through a min-heap
+  // of the next key of each.
+  const SkipNode *heap[LOCK_STRIPES];
+  size_t count = 0;
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    const SkipNode *entry = skiplist_seek(&ht->stripes[i].order, from);
+    if (entry != NULL) {
+      heap[count++] = entry;
+    }
+  }
+  for (size_t i = count / 2; i-- > 0;) {
+    sift_down(heap, count, i);
+  }
+  while (count > 0) {
+    const SkipNode *entry = heap[0];
+    if (to != NULL && strcmp(entry->key, to) > 0)
+      break;
+    KeyNode *keyNode = find_node(ht, entry->key, entry->hash);
+    if (keyNode != NULL) {
+      visit(keyNode, arg);
+    }
+    heap[0] = entry->next[0] != NULL ? entry->next[0] : heap[--count];
+    sift_down(heap, count, 0);
+  }
+}
+
+void view_open(HashTable *ht, TableView *view) {
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    atomic_init(&view->pending[i], 1);
+    view->copies[i] = NULL;
+    view->positions[i] = NULL;
+    view->copy_counts[i] = 0;
+  }
+  view->buckets = ht->table->size +
+                  (ht->old_table != NULL ? ht->old_table->size : 0);
+  atomic_init(&view->failed, 0);
+  pthread_mutex_lock(&ht->views_lock);
+  view->next = ht->views;
+  ht->views = view;
+  pthread_mutex_unlock(&ht->views_lock);
+}
+
+int view_capture(HashTable *ht, TableView *view) {
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    if (!atomic_load(&view->pending[i])) {
+      continue;
+    }
+    // no writer got there first; copy it now rather than keep it locked
+    // while the pairs are written out
+    StripeSet set = {0};
+    set.bits[i / 64] |= 1ULL << (i % 64);
+    lock_stripes(ht, &set, 0);
+    if (atomic_load(&view->pending[i])) {
+      capture_stripe(ht, view, i);
+    }
+    unlock_stripes(ht, &set);
+  }
+  return atomic_load(&view->failed);
+}
+
+void view_visit_buckets(TableView *view, size_t part, size_t parts,
+                        pair_visitor visit, void *arg) {
+  size_t first = view->buckets * part / parts;
+  size_t last = view->buckets * (part + 1) / parts;
+  // bucket b is in stripe b % LOCK_STRIPES of either array, and each stripe
+  // has its copies in bucket order: start each one at its first bucket
+  size_t next[LOCK_STRIPES];
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    size_t low = 0, high = view->copy_counts[i];
+    while (low < high) {
+      size_t mid = low + (high - low) / 2;
+      if (view->positions[i][mid] < first) {
+        low = mid + 1;
       } else {
-        // Node to delete is not the first; bypass it
-        prevNode->next =
-            keyNode->next; // Link the previous node to the next node
+        high = mid;
       }
-      // Free the memory allocated for the key and value
-      free(keyNode->key);
-      free(keyNode->value);
-      free(keyNode); // Free the key node itself
-      return 0;      // Exit the function
     }
-    prevNode = keyNode;      // Move prevNode to current node
-    keyNode = keyNode->next; // Move to the next node
+    next[i] = low;
+  }
+  for (size_t b = first; b < last; b++) {
+    size_t i = b % LOCK_STRIPES;
+    while (next[i] < view->copy_counts[i] && view->positions[i][next[i]] == b) {
+      visit(&view->copies[i][next[i]++], arg);
+    }
   }
+}
 
-  return 1;
+void view_close(HashTable *ht, TableView *view) {
+  lock_table(ht, 0);
+  pthread_mutex_lock(&ht->views_lock);
+  TableView **link = &ht->views;
+  while (*link != view) {
+    link = &(*link)->next;
+  }
+  *link = view->next;
+  pthread_mutex_unlock(&ht->views_lock);
+  unlock_table(ht);
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    free(view->copies[i]);
+    free(view->positions[i]);
+  }
 }
 
-void free_table(HashTable *ht) {
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = ht->table[i];
-    while (keyNode != NULL) {
-      KeyNode *temp = keyNode;
-      keyNode = keyNode->next;
-      free(temp->key);
-      free(temp->value);
-      free(temp);
+void chain_lengths(HashTable *ht, size_t *lengths, size_t max) {
+  Buckets *arrays[2] = {ht->old_table, ht->table};
+  for (size_t i = 0; i < max; i++) {
+    lengths[i] = 0;
+  }
+  for (int t = 0; t < 2; t++) {
+    for (size_t i = 0; arrays[t] != NULL && i < arrays[t]->size; i++) {
+      size_t length = 0;
+      for (KeyNode *keyNode = arrays[t]->heads[i]; keyNode != NULL;
+           keyNode = keyNode->next) {
+        length++;
+      }
+      lengths[length < max ? length : max - 1]++;
+    }
+  }
+}
+
+void visit_table(HashTable *ht, pair_visitor visit, void *arg) {
+  visit_buckets(ht, 0, 1, visit, arg);
+}
+
+void visit_buckets(HashTable *ht, size_t part, size_t parts,
+                   pair_visitor visit, void *arg) {
+  Buckets *old_table = ht->old_table;
+  Buckets *table = ht->table;
+  // the old buckets come first, as if both arrays were one
+  size_t old_size = old_table != NULL ? old_table->size : 0;
+  size_t total = old_size + table->size;
+  size_t last = total * (part + 1) / parts;
+  for (size_t i = total * part / parts; i < last; i++) {
+    visit_chain(i < old_size ? old_table->heads[i] : table->heads[i - old_size],
+                visit, arg);
+  }
+}
+
+// Fills a node that isn't linked anywhere yet.
+static void init_node(HashTable *ht, KeyNode *keyNode, const char *key,
+                      const char *value, uint64_t h) {
+  copy_string(keyNode->key, key);
+  copy_string(keyNode->value, value);
+  keyNode->hash = h;
+  keyNode->version = atomic_fetch_add(&ht->version, 1) + 1;
+}
+
+// Overwrites the value of a published node, whose stripe the caller holds
+// exclusively.
+static void store_value(HashTable *ht, KeyNode *keyNode, const char *value) {
+  uint64_t words[MAX_STRING_SIZE / 8];
+  copy_string((char *)words, value);
+  // the stripe's seq went odd before any of these; pairs with the fence in
+  // read_end
+  atomic_thread_fence(memory_order_release);
+  for (size_t i = 0; i < MAX_STRING_SIZE / 8; i++) {
+    atomic_store_explicit(&keyNode->value_words[i], words[i],
+                          memory_order_relaxed);
+  }
+  keyNode->version = atomic_fetch_add(&ht->version, 1) + 1;
+}
+
+int write_pair(HashTable *ht, const char *key, const char *value) {
+  uint64_t h = hash(key, ht->seed);
+  prepare_write(ht, h);
+
+  // prepare_write left the key's chain in the current table
+  Buckets *table = ht->table;
+  _Atomic(KeyNode *) *head = &table->heads[bucket_of(h, table->size)];
+  KeyNode *oldNode = find_in(head, key, h, NULL);
+  if (oldNode != NULL) {
+    // in place: a reader copying the value meanwhile retries
+    store_value(ht, oldNode, value);
+    return 0;
+  }
+
+  KeyNode *keyNode = alloc_node(ht);
+  if (!keyNode)
+    return 1;
+  init_node(ht, keyNode, key, value, h);
+
+  // Key not found, place the new key node at the start of the list
+  if (skiplist_insert(&ht->stripes[stripe_of(h)].order, keyNode->key, h)) {
+    free_node(ht, keyNode); // never published
+    return 1;
+  }
+  keyNode->next = *head;
+  *head = keyNode;
+  atomic_fetch_add(&ht->count, 1);
+  return 0;
+}
+
+int read_pair_into(HashTable *ht, const char *key, char *buffer, size_t size) {
+  KeyNode *keyNode = find_node(ht, key, hash(key, ht->seed));
+
+  if (keyNode == NULL || size == 0) {
+    return 1; // Key not found
+  }
+  // a word at a time, as a write may be overwriting it
+  uint64_t words[MAX_STRING_SIZE / 8];
+  for (size_t i = 0; i < MAX_STRING_SIZE / 8; i++) {
+    words[i] = atomic_load_explicit(&keyNode->value_words[i],
+                                    memory_order_relaxed);
+  }
+  // a torn copy may lack the terminator; the caller retries it anyway
+  size_t len = strnlen((const char *)words,
+                       size - 1 < MAX_STRING_SIZE - 1 ? size - 1
+                                                      : MAX_STRING_SIZE - 1);
+  memcpy(buffer, words, len);
+  buffer[len] = '\0';
+  return 0;
+}
+
+char *read_pair(HashTable *ht, const char *key) {
+  char value[MAX_STRING_SIZE];
+
+  if (read_pair_into(ht, key, value, sizeof(value)) == 0) {
+    return strdup(value); // Return copy of the value if found
+  }
+  return NULL; // Key not found
+}
+
+// Gives the deletion a version and, if tracking is on, records it. The
+// version is taken under the log lock so entries stay in version order.
+static void log_delete(HashTable *ht, const char *key) {
+  DeleteLog *log = &ht->deleted;
+  if (!log->enabled) {
+    atomic_fetch_add(&ht->version, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&log->lock);
+  uint64_t version = atomic_fetch_add(&ht->version, 1) + 1;
+  if (log->count == log->capacity) {
+    size_t capacity = log->capacity ? log->capacity * 2 : 1024;
+    DeletedKey *entries = realloc(log->entries, capacity * sizeof(DeletedKey));
+    if (!entries) {
+      // a delta may miss this key; the next full backup fixes it
+      pthread_mutex_unlock(&log->lock);
+      return;
     }
+    log->entries = entries;
+    log->capacity = capacity;
   }
+  copy_string(log->entries[log->count].key, key);
+  log->entries[log->count++].version = version;
+  pthread_mutex_unlock(&log->lock);
+}
+
+int delete_pair(HashTable *ht, const char *key) {
+  uint64_t h = hash(key, ht->seed);
+  prepare_write(ht, h);
+
+  Buckets *table = ht->table;
+  _Atomic(KeyNode *) *link;
+  KeyNode *keyNode =
+      find_in(&table->heads[bucket_of(h, table->size)], key, h, &link);
+  if (keyNode == NULL) {
+    return 1;
+  }
+
+  // Bypass the node; readers already on it still get to the rest of the chain
+  *link = keyNode->next;
+  skiplist_remove(&ht->stripes[stripe_of(h)].order, keyNode->key);
+  log_delete(ht, keyNode->key);
+  retire_node(ht, h, keyNode); // Give the node back to the pool later
+  atomic_fetch_sub(&ht->count, 1);
+  return 0;
+}
+
+uint64_t table_version(HashTable *ht) {
+  return atomic_load(&ht->version);
+}
+
+void track_deletes(HashTable *ht) {
+  pthread_mutex_lock(&ht->deleted.lock);
+  ht->deleted.enabled = 1;
+  pthread_mutex_unlock(&ht->deleted.lock);
+}
+
+// Index of the first entry newer than a version. The log lock is held.
+static size_t first_after(DeleteLog *log, uint64_t version) {
+  size_t low = 0, high = log->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (log->entries[mid].version <= version) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+size_t deleted_since(HashTable *ht, uint64_t version, DeletedKey **keys) {
+  DeleteLog *log = &ht->deleted;
+  pthread_mutex_lock(&log->lock);
+  size_t first = first_after(log, version);
+  size_t count = log->count - first;
+  *keys = malloc(count * sizeof(DeletedKey) + 1);
+  if (*keys == NULL) {
+    count = 0;
+  } else if (count > 0) {
+    memcpy(*keys, log->entries + first, count * sizeof(DeletedKey));
+  }
+  pthread_mutex_unlock(&log->lock);
+  return count;
+}
+
+void trim_deleted(HashTable *ht, uint64_t version) {
+  DeleteLog *log = &ht->deleted;
+  pthread_mutex_lock(&log->lock);
+  size_t first = first_after(log, version);
+  if (first > 0) {
+    memmove(log->entries, log->entries + first,
+            (log->count - first) * sizeof(DeletedKey));
+    log->count -= first;
+  }
+  pthread_mutex_unlock(&log->lock);
+}
+
+void free_table(HashTable *ht) {
+  // every node lives in a slab, so the chains don't need to be walked
+  while (ht->pool.slabs != NULL) {
+    Slab *slab = ht->pool.slabs;
+    ht->pool.slabs = slab->next;
+    free(slab);
+  }
+  if (cache.pool == &ht->pool) {
+    cache.pool = NULL;
+    cache.free_nodes = NULL;
+    cache.count = 0;
+  }
+  pthread_mutex_destroy(&ht->pool.lock);
+  free(ht->deleted.entries);
+  pthread_mutex_destroy(&ht->deleted.lock);
+  pthread_mutex_destroy(&ht->views_lock);
+
+  reclaim_buckets(ht, 1);
+  EpochRecord *record = atomic_load(&ht->readers);
+  while (record != NULL) {
+    EpochRecord *next = record->next;
+    free(record);
+    record = next;
+  }
+  if (reader.ht == ht) {
+    reader.ht = NULL;
+    reader.record = NULL;
+  }
+  free(ht->table);
+  free(ht->old_table);
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    pthread_rwlock_destroy(&ht->stripes[i].lock);
+    free(ht->stripes[i].retired);
+    skiplist_destroy(&ht->stripes[i].order);
+  }
+  pthread_rwlock_destroy(&ht->resize_lock);
   free(ht);
-}
\ No newline at end of file
+}
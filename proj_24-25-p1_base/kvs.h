@@ -1,28 +1,305 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+// Initial number of buckets. Must be a power of two.
+#define TABLE_SIZE 256
+// Number of bucket locks. A power of two no bigger than TABLE_SIZE, so a key
+// keeps its stripe across resizes.
+#define LOCK_STRIPES 64
+// The table doubles once it holds more than MAX_LOAD_FACTOR keys per bucket.
+#define MAX_LOAD_FACTOR 2
+// Old buckets moved to the new table by each write while a resize is running.
+#define MIGRATE_STEP 4
+// Nodes carved from the system at once by the node pool.
+#define SLAB_NODES 4096
+// Nodes a thread moves between its own free list and the shared one at once.
+#define NODE_CACHE_BATCH 64
+// Retired nodes a stripe collects before trying to give them back.
+#define RETIRE_BATCH 64
+// Lock-free attempts of a read before it falls back to the stripe locks.
+#define READ_RETRIES 4
 
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include "constants.h"
+#include "skiplist.h"
 
+
+// Keys and values are bounded by MAX_STRING_SIZE, so they live in the node
+// itself and a pair costs a single pool slot.
 typedef struct KeyNode {
-  char *key;
-  char *value;
-  struct KeyNode *next;
-  //pthread_rwlock_t locker_keynode;
+  char key[MAX_STRING_SIZE];
+  // Readers follow chains without locks. An overwrite changes the value in
+  // place, with the stripe held, so they copy it a word at a time and retry
+  // when the stripe's seq says it moved under them.
+  union {
+    char value[MAX_STRING_SIZE];
+    _Atomic uint64_t value_words[MAX_STRING_SIZE / 8];
+  };
+  uint64_t hash; // cached so resizes don't have to hash the key again
+  uint64_t version; // table version of the last write to this key
+  _Atomic(struct KeyNode *) next;
 } KeyNode;
 
+_Static_assert(MAX_STRING_SIZE % 8 == 0, "values are copied in words");
+
+typedef struct Slab {
+  struct Slab *next;
+  KeyNode nodes[SLAB_NODES];
+} Slab;
+
+// Allocator for the table's nodes. Threads keep a private free list and only
+// take the pool lock to exchange NODE_CACHE_BATCH nodes with it.
+typedef struct NodePool {
+  pthread_mutex_t lock;
+  Slab *slabs;         // every slab ever allocated, freed in bulk
+  size_t slab_used;    // nodes handed out from the newest slab
+  KeyNode *free_nodes; // nodes given back by threads
+} NodePool;
+
+typedef struct DeletedKey {
+  char key[MAX_STRING_SIZE];
+  uint64_t version;
+} DeletedKey;
+
+// Keys deleted since the oldest version anyone still asks about, in version
+// order. Only kept once enabled, for delta backups.
+typedef struct DeleteLog {
+  pthread_mutex_t lock;
+  int enabled;
+  DeletedKey *entries;
+  size_t count;
+  size_t capacity;
+} DeleteLog;
+
+// A node unlinked from the table, freed once no reader can still hold it.
+typedef struct RetiredNode {
+  KeyNode *node;
+  uint64_t epoch; // table epoch when it was unlinked
+} RetiredNode;
+
+// Bucket i is guarded by stripe i % LOCK_STRIPES. Each stripe sits in its own
+// cache line so that threads on different stripes don't share one.
+typedef struct Stripe {
+  _Alignas(64) pthread_rwlock_t lock;
+  // Odd while a writer holds the stripe, so lock-free readers can tell their
+  // view of it changed.
+  atomic_uint_fast64_t seq;
+  size_t migrate_pos; // next old bucket of this stripe to move on a resize
+  RetiredNode *retired; // only touched with the stripe held exclusively
+  size_t retired_count;
+  size_t retired_capacity;
+  SkipList order; // keys of the stripe, for sorted output and range scans
+} Stripe;
+
+// A bucket array. Readers may still walk one after a resize replaced it, so
+// it is only freed once they are done.
+typedef struct Buckets {
+  size_t size;
+  struct Buckets *retired_next;
+  uint64_t retired_epoch;
+  _Atomic(KeyNode *) heads[];
+} Buckets;
+
+// Announces the epoch a thread entered a lock-free read in, 0 outside one.
+typedef struct EpochRecord {
+  _Alignas(64) atomic_uint_fast64_t epoch;
+  struct EpochRecord *next;
+} EpochRecord;
+
+struct TableView;
+
 typedef struct HashTable {
-  KeyNode *table[TABLE_SIZE];
-  pthread_mutex_t locker_hashtable;
+  _Atomic(Buckets *) table;
+  // While resizing, buckets not yet moved to table. NULL otherwise.
+  _Atomic(Buckets *) old_table;
+  atomic_size_t stripes_migrated; // stripes with no old buckets left
+  atomic_size_t count;
+  uint64_t seed;
+  // Bumped by every write and delete; stable while the table is locked.
+  atomic_uint_fast64_t version;
+  DeleteLog deleted;
+  // Held shared by every locked operation; exclusive only to swap bucket
+  // arrays. Odd resize_seq while that happens.
+  pthread_rwlock_t resize_lock;
+  atomic_uint_fast64_t resize_seq;
+  Buckets *retired_buckets; // replaced arrays, guarded by resize_lock
+  // A node retired in epoch e is freed once the epoch reaches e + 2: by then
+  // every reader announced in a later epoch than e.
+  atomic_uint_fast64_t epoch;
+  _Atomic(EpochRecord *) readers; // one record per reading thread
+  NodePool pool;
+  // Open views, read by writers. Changed with every stripe locked and
+  // views_lock held, so backups opening views at once don't race.
+  struct TableView *views;
+  pthread_mutex_t views_lock;
+  Stripe stripes[LOCK_STRIPES];
 } HashTable;
 
 /// Creates a new event hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
+/// Grows the buckets so that count more keys fit without resizing. The
+/// table must not be in use by other threads.
+/// @param ht Hash table to grow.
+/// @param count Number of keys about to be inserted.
+/// @return 0 on success, 1 if there was no memory for the buckets.
+int reserve_table(HashTable *ht, size_t count);
+
+/// Locks the stripe that holds a key. Must be held around write_pair and
+/// delete_pair on that key, and around read_pair unless inside read_begin.
+/// @param ht Hash table to lock.
+/// @param key Key that will be accessed.
+/// @param exclusive 1 to modify the key, 0 to only read it.
+void lock_key(HashTable *ht, const char *key, int exclusive);
+
+/// Releases a lock taken by lock_key, and grows the table if it is due.
+/// @param ht Hash table to unlock.
+/// @param key Key given to lock_key.
+void unlock_key(HashTable *ht, const char *key);
+
+/// Set of stripes touched by a multi-key command, one bit per stripe.
+typedef struct StripeSet {
+  uint64_t bits[(LOCK_STRIPES + 63) / 64];
+} StripeSet;
+
+/// Adds the stripe that holds a key to a set.
+/// @param ht Hash table the key belongs to.
+/// @param set Set to add to. Must start zeroed.
+/// @param key Key that will be accessed.
+void stripe_set_add(HashTable *ht, StripeSet *set, const char *key);
+
+/// Locks every stripe of a set in increasing order, so commands with
+/// overlapping keys can't deadlock, and each stripe is taken only once.
+/// @param ht Hash table to lock.
+/// @param set Stripes to lock.
+/// @param exclusive 1 to modify the keys, 0 to only read them.
+void lock_stripes(HashTable *ht, const StripeSet *set, int exclusive);
+
+/// Releases a lock taken by lock_stripes, and grows the table if it is due.
+/// @param ht Hash table to unlock.
+/// @param set Set given to lock_stripes.
+void unlock_stripes(HashTable *ht, const StripeSet *set);
+
+/// Locks every stripe, in order, to walk the whole table.
+/// @param ht Hash table to lock.
+/// @param exclusive 1 to modify the table, 0 to only read it.
+void lock_table(HashTable *ht, int exclusive);
+
+/// Releases a lock taken by lock_table.
+/// @param ht Hash table to unlock.
+void unlock_table(HashTable *ht);
+
+/// State of a lock-free read. Must start zeroed.
+typedef struct ReadGuard {
+  unsigned attempts;
+  int locked; // fell back to lock_stripes
+  uint64_t resize_seq;
+  uint64_t seqs[LOCK_STRIPES];
+} ReadGuard;
+
+/// Starts reading the keys of a set without locking them. Nodes reached
+/// before read_end stay allocated even if a writer deletes them. After
+/// READ_RETRIES failed attempts the stripes are locked shared instead.
+/// @param ht Hash table to read.
+/// @param set Stripes of every key that will be read.
+/// @param guard Guard of this read, kept across retries.
+void read_begin(HashTable *ht, const StripeSet *set, ReadGuard *guard);
+
+/// Ends a read started by read_begin.
+/// @param ht Hash table given to read_begin.
+/// @param set Set given to read_begin.
+/// @param guard Guard given to read_begin.
+/// @return 0 if every read_pair_into since read_begin saw the same state of
+/// the table, 1 if a writer got in the way and the reads must be repeated.
+int read_end(HashTable *ht, const StripeSet *set, ReadGuard *guard);
+
+/// Called by visit_table for each pair.
+typedef void (*pair_visitor)(const KeyNode *keyNode, void *arg);
+
+/// Calls visit on every pair of the table, buckets left by a pending resize
+/// first. The caller holds the table locked.
+/// @param ht Hash table to walk.
+/// @param visit Function called for each pair.
+/// @param arg Passed to visit.
+void visit_table(HashTable *ht, pair_visitor visit, void *arg);
+
+/// Calls visit on the pairs of one of parts equal slices of the buckets, so
+/// that visiting every part in turn gives the same order as visit_table.
+/// Parts can be visited by different threads while the caller holds the
+/// table locked.
+/// @param ht Hash table to walk.
+/// @param part Slice to visit, from 0 to parts - 1.
+/// @param parts Number of slices.
+/// @param visit Function called for each pair.
+/// @param arg Passed to visit.
+void visit_buckets(HashTable *ht, size_t part, size_t parts,
+                   pair_visitor visit, void *arg);
+
+/// A point-in-time copy of the table, taken one stripe at a time. The first
+/// writer to lock a stripe the view still needs copies it before changing
+/// anything, so the reader of the view never holds up writers for long.
+typedef struct TableView {
+  struct TableView *next;
+  atomic_bool pending[LOCK_STRIPES]; // stripe not copied yet
+  KeyNode *copies[LOCK_STRIPES];     // pairs of each copied stripe
+  size_t *positions[LOCK_STRIPES];   // bucket of each copy, old array first
+  size_t copy_counts[LOCK_STRIPES];
+  size_t buckets; // buckets of both arrays when the view was opened
+  atomic_int failed; // a stripe couldn't be copied
+} TableView;
+
+/// Opens a view of the table as it is now. The caller holds the table
+/// locked, so the view matches table_version and count at that moment.
+/// @param ht Hash table to view.
+/// @param view View to open.
+void view_open(HashTable *ht, TableView *view);
+
+/// Copies the stripes no writer copied yet, so the view can be visited.
+/// @param ht Hash table given to view_open.
+/// @param view Open view.
+/// @return 0 on success, 1 if part of the view was lost for lack of memory.
+int view_capture(HashTable *ht, TableView *view);
+
+/// Calls visit on the pairs of one of parts equal slices of a captured view,
+/// in the order visit_buckets gave when the view was opened. Parts can be
+/// visited by different threads.
+/// @param view View given to view_capture.
+/// @param part Slice to visit, from 0 to parts - 1.
+/// @param parts Number of slices.
+/// @param visit Function called for each pair.
+/// @param arg Passed to visit.
+void view_visit_buckets(TableView *view, size_t part, size_t parts,
+                        pair_visitor visit, void *arg);
+
+/// Closes a view, so writers stop copying stripes for it. Must not be
+/// called with the table locked.
+/// @param ht Hash table given to view_open.
+/// @param view View to close.
+void view_close(HashTable *ht, TableView *view);
+
+/// Counts the buckets with each chain length. The caller holds the table
+/// locked.
+/// @param ht Hash table to inspect.
+/// @param lengths Set so that lengths[i] buckets hold i nodes; the last entry
+/// also counts longer chains.
+/// @param max Entries in lengths.
+void chain_lengths(HashTable *ht, size_t *lengths, size_t max);
+
+/// Calls visit on the pairs with keys between from and to, both included, in
+/// key order. The caller holds the table locked.
+/// @param ht Hash table to walk.
+/// @param from Smallest key visited, NULL for no lower bound.
+/// @param to Largest key visited, NULL for no upper bound.
+/// @param visit Function called for each pair.
+/// @param arg Passed to visit.
+void visit_range(HashTable *ht, const char *from, const char *to,
+                 pair_visitor visit, void *arg);
+
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
 /// @param key Key of the pair to be written.
@@ -30,10 +307,20 @@ struct HashTable *create_hash_table();
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
-/// Deletes the value of given key.
-/// @param ht Hash table to delete from.
-/// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
+/// Copies the value of a key into a caller provided buffer, without
+/// allocating.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @param buffer Where the value is copied to, truncated to size - 1 bytes.
+/// @param size Size of buffer.
+/// @return 0 if the key was found, 1 otherwise.
+int read_pair_into(HashTable *ht, const char *key, char *buffer, size_t size);
+
+/// Reads the value of given key.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @return Copy of the value that the caller must free, NULL if the key
+/// doesn't exist.
 char *read_pair(HashTable *ht, const char *key);
 
 /// Appends a new node to the list.
@@ -42,6 +329,27 @@ char *read_pair(HashTable *ht, const char *key);
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Returns the version of the last write or delete.
+/// @param ht Hash table to query.
+/// @return Current table version, 0 if the table was never modified.
+uint64_t table_version(HashTable *ht);
+
+/// Starts recording deleted keys, so delete_pair feeds deleted_since.
+/// @param ht Hash table to track.
+void track_deletes(HashTable *ht);
+
+/// Copies the keys deleted after a version.
+/// @param ht Hash table to query.
+/// @param version Only deletions newer than this are returned.
+/// @param keys Set to a newly allocated array the caller must free.
+/// @return Number of keys in the array.
+size_t deleted_since(HashTable *ht, uint64_t version, DeletedKey **keys);
+
+/// Forgets deletions that no caller of deleted_since needs anymore.
+/// @param ht Hash table to trim.
+/// @param version Deletions up to this version are dropped.
+void trim_deleted(HashTable *ht, uint64_t version);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
@@ -1,3 +1,6 @@
+// syscall(), for getdents64
+#define _DEFAULT_SOURCE
+
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -6,316 +9,1633 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/wait.h>
 #include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <linux/memfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include "constants.h"
 #include "operations.h"
+#include "output.h"
 #include "parser.h"
+#include "ring.h"
+#include "stats.h"
+
+
 
 
+int max_threads, max_backups, queue_size;
 
+// Whether long jobs are parsed by a thread of their own (-i).
+int pipelined_jobs = 0;
+// Whether jobs hold back writes until something observes them (-c).
+int coalesced_jobs = 0;
+// Whether the first pass queues the largest jobs first (-o).
+int longest_first = 0;
+// Whether per-thread busy time is reported on exit (-u).
+int report_usage = 0;
+// Jobs shorter than this aren't worth a second thread.
+#define PIPELINE_MIN_SIZE (4 * READ_BUFFER_SIZE)
+// Commands the parser of a pipelined job can read ahead.
+#define PIPELINE_DEPTH 16
+// Streams a long job is split into by its keys (-j), 0 to run it whole.
+int split_streams = 0;
+#define SPLIT_MAX_STREAMS 64
+// Jobs shorter than this aren't worth splitting.
+#define SPLIT_MIN_SIZE (16 * READ_BUFFER_SIZE)
+// Commands each stream can have queued.
+#define SPLIT_DEPTH 16
+// Commands after which the streams are synced anyway, so the output and
+// writes they hold back stay bounded.
+#define SPLIT_SYNC_INTERVAL 65536
+// Bytes of logged WRITEs and DELETEs after which the streams are synced.
+#define SPLIT_LOG_SIZE (16 * 1024 * 1024)
+// WRITEs, READs and DELETEs at the start of a job that tell whether it's
+// worth splitting, and the percentage of them that may span several streams.
+// Each of those costs a copy and a handoff per stream it spans, so past a
+// quarter of them the job runs whole.
+#define SPLIT_SCAN_COMMANDS 4096
+#define SPLIT_MAX_SPANNING 25
+// Slots a stream starts with for the writes it holds, a power of two. Half
+// of them take more keys than the commands a stream can have queued.
+#define SPLIT_HELD_SLOTS 16384
 
-int max_threads, max_backups, file_counter = 0, queue_size;
+// A command of a job with its arguments, as read_command left it.
+struct job_command {
+  enum Command command;
+  size_t num_pairs;
+  unsigned int delay;
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+};
 
+// locker guards the job queue. Idle threads sleep on queue_cond until a job
+// arrives or the queue is closed; whoever queues jobs sleeps on space_cond
+// while the queue holds queue_size of them.
 pthread_mutex_t locker = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+int queue_closed = 0;
+
+// Names of the jobs found by the first pass over the directory, sorted, so
+// watch mode doesn't queue them again for events that were already pending.
+struct name_set {
+  char **names;
+  size_t count;
+  size_t capacity;
+};
 
 struct file_t{
     char name [MAX_JOB_FILE_NAME_SIZE];
-    char directory [MAX_JOB_FILE_NAME_SIZE];
     int backup_count;
-    int process_count;
-    pthread_mutex_t file_lock;
 } ;
 
-typedef struct queue_node *queue;
+// Jobs waiting for a thread, in a ring of queue_size names: the queue takes
+// the same memory however many files the directory has.
+struct job_queue {
+  char (*names)[MAX_JOB_FILE_NAME_SIZE];
+  int head;  // oldest job
+  int count; // jobs in the ring
+};
+
+struct job_queue q;
+
+// Directory every job is read from.
+const char *jobs_directory;
 
-struct queue_node {
-  struct file_t file;
-  queue next;
+// A job found by the first pass, with what orders it under -o.
+struct sized_job {
+  long priority;  // from a "#PRIORITY <n>" first line, 0 without one
+  off_t size;     // bytes, standing for how long the job takes
+  size_t name;    // offset of the name in job_list.names
+  size_t seq;     // position in the directory, the last tie breaker
 };
 
-struct list {
-  queue head;
-  queue tail;
+// Every job of the directory, so the longest can be queued first. The names
+// go into one growing buffer rather than one allocation each.
+struct job_list {
+  struct sized_job *jobs;
+  size_t count;
+  size_t capacity;
+  char *names;
+  size_t names_len;
+  size_t names_capacity;
 };
 
+// Jobs run and time spent on them by a worker thread.
+struct thread_usage {
+  unsigned int jobs;
+  uint64_t busy_ns;
+};
 
+// First line by which a job asks to run before larger jobs.
+#define PRIORITY_HINT "#PRIORITY"
 
-typedef struct list *Q;
+// Bytes of directory entries read by each getdents64 call.
+#define DIRENT_BUFFER_SIZE (256 * 1024)
 
-  Q q;
+// Entry returned by getdents64, which glibc doesn't declare.
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
 
 
-int kvs_processor(int input_fd, int output_fd, char input_path[], struct file_t file);
-void insert_to_end( struct file_t file);
-queue new_args (struct file_t file, queue next);
-void init_head_and_tail();
+int kvs_processor(int input_fd, OutputBuffer *out, char input_path[], struct file_t file);
+void read_command(int input_fd, struct job_command *cmd);
+void run_command(struct job_command *cmd, OutputBuffer *out, char input_path[],
+                 struct file_t *file, BackupChain *chain, WriteBatch *batch);
+void apply_batch(WriteBatch *batch);
+int is_job_name(const char *name);
+void enqueue_job(const char *name);
+long job_priority(int dir_fd, const char *name);
+int add_sized_job(struct job_list *list, const char *name, off_t size,
+                  long priority);
+int compare_sized_jobs(const void *a, const void *b);
+void queue_longest_first(struct job_list *list);
+uint64_t now_ns();
+void print_usage(const struct thread_usage *workers, uint64_t elapsed_ns);
+int scan_jobs(int dir_fd, struct name_set *scanned, time_t changed_since);
+int watch_jobs(int watch_fd, const sigset_t *signals, struct name_set *scanned);
+void remember_name(struct name_set *set, const char *name);
+int compare_names(const void *a, const void *b);
+void *parse_job(void *arg);
+int worth_pipelining(int input_fd);
+int worth_splitting(int input_fd);
+int run_split_job(int input_fd, OutputBuffer *out, char input_path[],
+                  struct file_t *file, BackupChain *chain);
+void insert_to_end(const char *name);
+int init_queue();
 void *thread_processer(void* arg);
-struct file_t get_and_delete();
+void get_and_delete(struct file_t *file);
 int q_empty();
+void close_queue();
+int wait_for_job(struct file_t *file);
+int rebuild_backup(const char *backup_path);
+
+void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-d <checkpoint interval> | -b] [-s] [-i] [-c] [-f] [-o] [-u] [-j <streams>] [-p <dump threads>] [-l <backup file>] [-w <log file> [-g <commit delay us>]] <jobs path> <max backup> <max threads>\n"
+          "       %s -r <backup file>\n",
+          name, name);
+}
 
 int main(int argc, char *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <jobs path> <max backup> <max threads>\n", argv[0]);
+  unsigned int checkpoint_interval = 0;
+  int binary_backups = 0;
+  int sorted_output = 0;
+  int watch = 0;
+  unsigned int dump_threads = 1;
+  const char *rebuild_path = NULL;
+  const char *load_path = NULL;
+  const char *wal_path = NULL;
+  unsigned int commit_delay_us = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:r:bl:w:g:sicfoup:j:")) != -1) {
+    switch (opt) {
+    case 'd':
+      checkpoint_interval = (unsigned int)atoi(optarg);
+      break;
+    case 'b':
+      binary_backups = 1;
+      break;
+    case 's':
+      sorted_output = 1;
+      break;
+    case 'i':
+      pipelined_jobs = 1;
+      break;
+    case 'c':
+      coalesced_jobs = 1;
+      break;
+    case 'f':
+      watch = 1;
+      break;
+    case 'o':
+      longest_first = 1;
+      break;
+    case 'u':
+      report_usage = 1;
+      break;
+    case 'j':
+      split_streams = atoi(optarg);
+      break;
+    case 'p':
+      dump_threads = (unsigned int)atoi(optarg);
+      break;
+    case 'l':
+      load_path = optarg;
+      break;
+    case 'w':
+      wal_path = optarg;
+      break;
+    case 'g':
+      commit_delay_us = (unsigned int)atoi(optarg);
+      break;
+    case 'r':
+      rebuild_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (rebuild_path != NULL && optind == argc) {
+    return rebuild_backup(rebuild_path);
+  }
+  if (rebuild_path != NULL || argc - optind != 3 ||
+      (binary_backups && checkpoint_interval > 1) || split_streams < 0 ||
+      split_streams > SPLIT_MAX_STREAMS) {
+    usage(argv[0]);
     return 1;
   }
+  // a batch applied while the table is resizing moves buckets at other
+  // points than the commands it holds would, so only key order is the same
+  if (coalesced_jobs && !sorted_output) {
+    fprintf(stderr, "-c needs -s, so SHOW lists pairs in the same order\n");
+    return 1;
+  }
+  char **args = argv + optind;
+
+  // With -f, SIGINT and SIGTERM are blocked in every thread, which inherit
+  // the mask, and only reach the watch_jobs loop through the signalfd.
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  if (watch) {
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+  }
 
   if (kvs_init()) {
     fprintf(stderr, "Failed to initialize KVS\n");
     return 1;
   }
-  
-  
-  max_threads = atoi(argv[3]);
-  max_backups = atoi(argv[2]);
-  DIR *dir = opendir(argv[1]);
-  struct dirent* dp;
+  if (kvs_enable_deltas(checkpoint_interval)) {
+    return 1;
+  }
+  if (binary_backups) {
+    kvs_enable_snapshots();
+  }
+  if (sorted_output) {
+    kvs_enable_sorted_output();
+  }
+  kvs_enable_parallel_dump(dump_threads);
+  // warm start, before any thread touches the table
+  if (load_path != NULL && kvs_load(load_path)) {
+    fprintf(stderr, "Failed to load backup %s\n", load_path);
+    kvs_terminate();
+    return 1;
+  }
+  if (wal_path != NULL && kvs_enable_wal(wal_path, commit_delay_us)) {
+    fprintf(stderr, "Failed to open log %s\n", wal_path);
+    kvs_terminate();
+    return 1;
+  }
+
+  max_threads = atoi(args[2]);
+  max_backups = atoi(args[1]);
+  kvs_enable_backups(max_backups > 0 ? (unsigned int)max_backups : 0);
+  jobs_directory = args[0];
+  int dir_fd = open(args[0], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
   queue_size = max_threads;
   pthread_mutex_init(&locker,NULL);
 
-  if (!dir) {
+  if (dir_fd == -1) {
     fprintf(stderr, "Failed to open directory\n");
     return 1;
   }
   
   pthread_t thread[max_threads];
-  init_head_and_tail(q);
-  
-  
-  
-  while ((dp = readdir(dir)) != NULL) {
-    struct file_t new_file;
-    strncpy(new_file.name, dp->d_name, MAX_JOB_FILE_NAME_SIZE);
-    strncpy(new_file.directory, argv[1], MAX_JOB_FILE_NAME_SIZE);
-    new_file.backup_count = 0;
-    new_file.process_count = 0;
-    insert_to_end(new_file);
-    file_counter++;
+  if (init_queue()) {
+    fprintf(stderr, "Failed to allocate the job queue\n");
+    return 1;
   }
 
+  // With -f the directory is watched before the first pass, so jobs written
+  // in the meantime aren't missed.
+  int watch_fd = -1;
+  struct name_set scanned = {NULL, 0, 0};
+  time_t watch_start = time(NULL);
+  if (watch) {
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd == -1 ||
+        inotify_add_watch(watch_fd, args[0], IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+      fprintf(stderr, "Failed to watch directory: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+
+  struct thread_usage workers[max_threads];
+  memset(workers, 0, sizeof(workers));
+  uint64_t start_ns = now_ns();
   for(int i = 0; i < max_threads; ++i) {
-    if(pthread_create(&thread[i], NULL, thread_processer, (void*)q) != 0){
+    if(pthread_create(&thread[i], NULL, thread_processer, &workers[i]) != 0){
       fprintf(stderr, "Failed to create thread: %s\n", strerror(errno));
       return 1;
     }
   }
-  
+
+  // the threads start working as soon as the first job is queued
+  int result = scan_jobs(dir_fd, watch ? &scanned : NULL, watch_start);
+  if (watch && result == 0) {
+    result = watch_jobs(watch_fd, &stop_signals, &scanned);
+  }
+  if (watch) {
+    close(watch_fd);
+  }
+  // jobs already queued still run before the threads exit
+  close_queue();
+
   for (int i = 0; i < max_threads; i++){
     if(pthread_join(thread[i], NULL) != 0){
         fprintf(stderr, "Failed to join thread begining: %s\n", strerror(errno));
         return 1;
     }
   }
+  if (report_usage) {
+    print_usage(workers, now_ns() - start_ns);
+  }
   pthread_mutex_destroy(&locker);
+  pthread_cond_destroy(&queue_cond);
+  pthread_cond_destroy(&space_cond);
+#ifdef KVS_STATS
+  OutputBuffer summary;
+  output_init(&summary, STDERR_FILENO);
+  kvs_stats(&summary);
+  output_close(&summary);
+#endif
+  kvs_terminate();
+  close(dir_fd);
+  free(q.names);
+
+  return result;
+}
+
+// Tool mode: prints the full content of a (possibly delta) backup.
+int rebuild_backup(const char *backup_path) {
+  if (kvs_init()) {
+    fprintf(stderr, "Failed to initialize KVS\n");
+    return 1;
+  }
+
+  OutputBuffer out;
+  output_init(&out, STDOUT_FILENO);
+  int result = kvs_rebuild_backup(backup_path, &out);
+  if (output_close(&out)) {
+    result = 1;
+  }
   kvs_terminate();
-  closedir(dir);
+  return result;
+}
+
+// Reads the next command of a job and its arguments.
+// @return 1 if its arguments are valid, 0 otherwise.
+int parse_command(int input_fd, struct job_command *cmd) {
+  int valid = 1;
+  cmd->command = get_next(input_fd);
+  switch (cmd->command) {
+  case CMD_WRITE:
+    cmd->num_pairs = parse_write(input_fd, cmd->keys, cmd->values,
+                                 MAX_WRITE_SIZE, MAX_STRING_SIZE);
+    valid = cmd->num_pairs != 0;
+    break;
+
+  case CMD_READ:
+  case CMD_DELETE:
+    cmd->num_pairs =
+        parse_read_delete(input_fd, cmd->keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+    valid = cmd->num_pairs != 0;
+    break;
+
+  case CMD_SCAN:
+    // [from,to]: exactly two keys
+    cmd->num_pairs = parse_read_delete(input_fd, cmd->keys, 3, MAX_STRING_SIZE);
+    valid = cmd->num_pairs == 2;
+    break;
+
+  case CMD_WAIT:
+    valid = parse_wait(input_fd, &cmd->delay, NULL) != -1;
+    break;
+
+  case CMD_SHOW:
+  case CMD_STATS:
+  case CMD_BACKUP:
+  case CMD_HELP:
+  case CMD_EMPTY:
+  case CMD_INVALID:
+  case EOC:
+    break;
+  }
+  return valid;
+}
+
+// Reads the next command of a job and its arguments. Commands with bad
+// arguments are reported and skipped.
+void read_command(int input_fd, struct job_command *cmd) {
+  while (!parse_command(input_fd, cmd)) {
+    fprintf(stderr, "Invalid command. See HELP for usage\n");
+  }
+}
+
+// Applies the writes a job held back, before a command that can see them.
+void apply_batch(WriteBatch *batch) {
+  if (batch != NULL && kvs_batch_flush(batch)) {
+    fprintf(stderr, "Failed to write pair\n");
+  }
+}
+
+// Runs a command read by read_command. With a batch, writes are held in it
+// until a later command could observe them.
+void run_command(struct job_command *cmd, OutputBuffer *out, char input_path[],
+                 struct file_t *file, BackupChain *chain, WriteBatch *batch) {
+  switch (cmd->command) {
+  case CMD_WRITE:
+    if (batch ? kvs_batch_write(batch, cmd->num_pairs, cmd->keys, cmd->values)
+              : kvs_write(cmd->num_pairs, cmd->keys, cmd->values)) {
+      fprintf(stderr, "Failed to write pair\n");
+    }
+    break;
+
+  case CMD_READ:
+    if (batch ? kvs_batch_read(batch, cmd->num_pairs, cmd->keys, out)
+              : kvs_read(cmd->num_pairs, cmd->keys, out)) {
+      fprintf(stderr, "Failed to read pair\n");
+    }
+    break;
+
+  case CMD_DELETE:
+    if (batch ? kvs_batch_delete(batch, cmd->num_pairs, cmd->keys, out)
+              : kvs_delete(cmd->num_pairs, cmd->keys, out)) {
+      fprintf(stderr, "Failed to delete pair\n");
+    }
+    break;
+
+  case CMD_SHOW:
+    apply_batch(batch);
+    kvs_show(out);
+    break;
+
+  case CMD_SCAN:
+    apply_batch(batch);
+    kvs_scan(cmd->keys[0], cmd->keys[1], out);
+    break;
+
+  case CMD_STATS:
+    apply_batch(batch);
+    kvs_stats(out);
+    break;
+
+  case CMD_WAIT:
+    apply_batch(batch);
+    if (cmd->delay > 0) {
+      output_puts(out, "Waiting...\n");
+      // the thread is about to sleep anyway, so let the output catch up
+      output_flush(out);
+      kvs_wait(cmd->delay);
+    }
+    break;
+
+  case CMD_BACKUP:
+    apply_batch(batch);
+    file->backup_count++;
+
+    // the backup limit is global; kvs_backup only waits if it's reached
+    if (kvs_backup(input_path, file->backup_count, chain)) {
+      fprintf(stderr, "Failed to create backup\n");
+    }
+    break;
+
+  case CMD_INVALID:
+    fprintf(stderr, "Invalid command. See HELP for usage\n");
+    break;
+
+  case CMD_HELP: {
+    char *buf = "Available commands:\n  WRITE [(key,value)(key2,value2),...]\n"
+                "  READ [key,key2,...]\n"
+                "  DELETE [key,key2,...]\n"
+                "  SHOW\n"
+                "  SCAN [from,to]\n"
+                "  STATS\n"
+                "  WAIT <delay_ms>\n"
+                "  BACKUP\n" // Not implemented
+                "  HELP\n";
+    output_puts(out, buf);
+
+    break;
+  }
+  case EOC:
+    apply_batch(batch);
+    break;
 
+  case CMD_EMPTY:
+    break;
+  }
+}
+
+struct job_parser {
+  int input_fd;
+  Ring ring;
+};
+
+// Parser stage of a pipelined job: reads commands into the ring ahead of the
+// thread running them, up to the end of the job.
+void *parse_job(void *arg) {
+  struct job_parser *parser = arg;
+  enum Command command;
+  do {
+    struct job_command *cmd = ring_reserve(&parser->ring);
+    read_command(parser->input_fd, cmd);
+    command = cmd->command;
+    ring_publish(&parser->ring);
+  } while (command != EOC);
+  return NULL;
+}
+
+// Whether a job is long enough for a parser thread of its own.
+int worth_pipelining(int input_fd) {
+  struct stat st;
+  return pipelined_jobs && fstat(input_fd, &st) == 0 &&
+         st.st_size >= PIPELINE_MIN_SIZE;
+}
+
+// What a stream of a split job does with an item of its ring.
+enum split_step {
+  SPLIT_RUN,   // runs a command on keys of the stream alone
+  SPLIT_CROSS, // runs its part of a command spanning several streams
+  SPLIT_SYNC,  // waits at the barrier until the job thread merged the output
+  SPLIT_STOP,  // like SPLIT_SYNC, then exits
+};
+
+// A command with keys of several streams. Each stream runs its part when it
+// gets there, without waiting for the others, and the last one writes the
+// reply and frees it.
+struct split_cross {
+  struct job_command cmd;
+  unsigned char owner[MAX_WRITE_SIZE];          // stream of each key
+  unsigned char held[MAX_WRITE_SIZE];           // what the owner held of it
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE]; // value it held, if any
+  atomic_int left;
+};
+
+struct split_item {
+  enum split_step step;
+  size_t seq; // position of the command in the job
+  struct split_cross *cross;
+  struct job_command cmd;
+};
+
+// Where the output of a command ends in its stream's memory file.
+struct split_mark {
+  size_t seq;
+  size_t end;
+};
+
+// Last write or deletion of a key by a stream since the last sync.
+struct split_held {
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  unsigned char state; // HELD_NONE while the slot is free
+};
+
+struct split_stream {
+  Ring ring;
+  pthread_t thread;
+  int id;
+  pthread_barrier_t *barrier;
+  // output of the stream's commands since the last sync, in a memory file
+  int out_fd;
+  OutputBuffer out;
+  int failed; // a flush of out failed
+  struct split_mark *marks;
+  size_t num_marks;
+  size_t marks_capacity;
+  // writes of the stream's keys the table doesn't have yet, by key
+  struct split_held *held;
+  size_t held_count;
+  size_t held_mask; // slots - 1
+  atomic_int *full; // set when held couldn't grow, so the job thread syncs
+};
+
+// Header of a WRITE or DELETE in the log of a split job, followed by its keys
+// and, for a WRITE, its values.
+struct split_logged {
+  enum Command command;
+  size_t num_pairs;
+};
+
+// A job whose commands run on several streams, each owning the keys that hash
+// to it: commands on disjoint keys commute, so every stream runs its commands
+// in job order without waiting for the others. Streams only hold WRITEs and
+// DELETEs back, to answer the READs and DELETEs after them; the job thread
+// applies them to the table at the next sync, in job order, so the table
+// ends up as if the job ran whole, down to the order of each bucket. Commands
+// that see the whole table are barriers, run by the job thread after a sync,
+// and the streams' output is put back in job order there.
+struct split_job {
+  int streams;
+  struct split_stream stream[SPLIT_MAX_STREAMS];
+  pthread_barrier_t barrier;
+  atomic_int full;
+  // WRITEs and DELETEs since the last sync, in job order
+  char *log;
+  size_t log_used;
+  size_t log_capacity;
+  WriteBatch *batch; // with -c
+};
+
+// FNV-1a: any hash works, as long as a key always lands on the same stream.
+uint64_t key_hash(const char *key) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const unsigned char *c = (const unsigned char *)key; *c != '\0'; c++) {
+    h = (h ^ *c) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+int stream_of(const char *key, int streams) {
+  return (int)(key_hash(key) % (uint64_t)streams);
+}
+
+// Copies a command, only as far as the pairs it has.
+void copy_command(struct job_command *dest, const struct job_command *src) {
+  dest->command = src->command;
+  dest->num_pairs = src->num_pairs;
+  dest->delay = src->delay;
+  memcpy(dest->keys, src->keys, src->num_pairs * MAX_STRING_SIZE);
+  if (src->command == CMD_WRITE) {
+    memcpy(dest->values, src->values, src->num_pairs * MAX_STRING_SIZE);
+  }
+}
+
+// Slot of a key in the writes a stream holds: its own, or the free one where
+// it goes.
+struct split_held *find_held(struct split_stream *stream, const char *key) {
+  size_t mask = stream->held_mask;
+  // the low bits of the hash picked the stream, so the slot takes the high ones
+  for (size_t i = (size_t)(key_hash(key) >> 32) & mask;; i = (i + 1) & mask) {
+    struct split_held *slot = &stream->held[i];
+    if (slot->state == HELD_NONE || strcmp(slot->key, key) == 0) {
+      return slot;
+    }
+  }
+}
+
+// Doubles the slots for the writes a stream holds.
+// @return 0 on success, 1 if there was no memory for them.
+int grow_held(struct split_stream *stream) {
+  size_t slots = stream->held_mask + 1;
+  struct split_held *old = stream->held;
+  struct split_held *held = calloc(2 * slots, sizeof(struct split_held));
+  if (!held) {
+    return 1;
+  }
+  stream->held = held;
+  stream->held_mask = 2 * slots - 1;
+  for (size_t i = 0; i < slots; i++) {
+    if (old[i].state != HELD_NONE) {
+      *find_held(stream, old[i].key) = old[i];
+    }
+  }
+  free(old);
   return 0;
 }
 
-int kvs_processor(int input_fd, int output_fd, char input_path[], struct file_t file) {
-    while (1) {
-      char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-      char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-      unsigned int delay;
-      size_t num_pairs;
-
-      switch (get_next(input_fd)) {
-      case CMD_WRITE:
-        num_pairs =
-            parse_write(input_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
+// Holds a write of a key of the stream, or its deletion if value is NULL,
+// until the next sync.
+void hold(struct split_stream *stream, const char *key, const char *value) {
+  if (2 * (stream->held_count + 1) > stream->held_mask + 1 &&
+      grow_held(stream) != 0) {
+    // the half still free takes every command the stream can have queued
+    // before the job thread sees this and syncs
+    atomic_store(stream->full, 1);
+  }
+  struct split_held *slot = find_held(stream, key);
+  if (slot->state == HELD_NONE) {
+    strcpy(slot->key, key);
+    stream->held_count++;
+  }
+  if (value != NULL) {
+    strcpy(slot->value, value);
+    slot->state = HELD_VALUE;
+  } else {
+    slot->state = HELD_DELETED;
+  }
+}
 
-        if (kvs_write(num_pairs, keys, values)) {
-          fprintf(stderr, "Failed to write pair\n");
-        }
+// What a stream holds of a key, copying the value to value if it's written.
+unsigned char held_state(struct split_stream *stream, const char *key,
+                         char *value) {
+  struct split_held *slot = find_held(stream, key);
+  if (slot->state == HELD_VALUE) {
+    strcpy(value, slot->value);
+  }
+  return slot->state;
+}
 
-        break;
+// Forgets the writes a stream held, once the table has them.
+void clear_held(struct split_stream *stream) {
+  if (stream->held_count > 0) {
+    memset(stream->held, 0, (stream->held_mask + 1) * sizeof(struct split_held));
+    stream->held_count = 0;
+  }
+}
 
-      case CMD_READ:
-        num_pairs =
-            parse_read_delete(input_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+// Runs the part of a command on the keys of the stream, those with owner[i]
+// equal to its id, or every key if owner is NULL. READs and DELETEs note what
+// the stream held of each key in held and values, for the reply.
+void run_keys(struct split_stream *stream, struct job_command *cmd,
+              const unsigned char *owner, unsigned char *held,
+              char values[][MAX_STRING_SIZE]) {
+  for (size_t i = 0; i < cmd->num_pairs; i++) {
+    if (owner != NULL && owner[i] != stream->id) {
+      continue;
+    }
+    if (cmd->command == CMD_WRITE) {
+      hold(stream, cmd->keys[i], cmd->values[i]);
+      continue;
+    }
+    held[i] = held_state(stream, cmd->keys[i], values[i]);
+    if (cmd->command == CMD_DELETE) {
+      hold(stream, cmd->keys[i], NULL);
+    }
+  }
+}
 
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
+// Writes the reply of a READ or DELETE whose keys were all looked up, and
+// notes where it ends.
+void reply_marked(struct split_stream *stream, struct job_command *cmd,
+                  const unsigned char *held, char values[][MAX_STRING_SIZE],
+                  size_t seq) {
+  size_t before = stream->out.written;
+  if (cmd->command == CMD_READ) {
+    if (kvs_read_held(cmd->num_pairs, cmd->keys, values, held, &stream->out)) {
+      fprintf(stderr, "Failed to read pair\n");
+    }
+  } else if (kvs_delete_reply(cmd->num_pairs, cmd->keys, held, &stream->out)) {
+    fprintf(stderr, "Failed to delete pair\n");
+  }
+  if (stream->out.written == before) {
+    return;
+  }
+  if (stream->num_marks == stream->marks_capacity) {
+    size_t capacity = stream->marks_capacity ? stream->marks_capacity * 2 : 256;
+    struct split_mark *marks =
+        realloc(stream->marks, capacity * sizeof(struct split_mark));
+    if (!marks) {
+      // without a mark this output is merged with the previous command's
+      stream->failed = 1;
+      return;
+    }
+    stream->marks = marks;
+    stream->marks_capacity = capacity;
+  }
+  stream->marks[stream->num_marks++] = (struct split_mark){seq, stream->out.written};
+}
 
-        if (kvs_read(num_pairs, keys, output_fd)) {
-          fprintf(stderr, "Failed to read pair\n");
-        }
-        break;
+// Runs a command on keys of the stream alone.
+void run_local(struct split_stream *stream, struct job_command *cmd,
+               size_t seq) {
+  STATS_TIME(start);
+  unsigned char held[MAX_WRITE_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  run_keys(stream, cmd, NULL, held, values);
+  if (cmd->command != CMD_WRITE) {
+    reply_marked(stream, cmd, held, values, seq);
+  }
+  STATS_COMMAND(cmd->command, start);
+}
 
-      case CMD_DELETE:
-        num_pairs =
-            parse_read_delete(input_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+void run_cross(struct split_stream *stream, struct split_cross *cross,
+               size_t seq) {
+  run_keys(stream, &cross->cmd, cross->owner, cross->held, cross->values);
+  if (atomic_fetch_sub(&cross->left, 1) == 1) {
+    if (cross->cmd.command != CMD_WRITE) {
+      reply_marked(stream, &cross->cmd, cross->held, cross->values, seq);
+    }
+    free(cross);
+  }
+}
 
-        if (num_pairs == 0) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
+// Thread of a stream: runs what the job thread hands it until SPLIT_STOP.
+void *run_stream(void *arg) {
+  struct split_stream *stream = arg;
+  enum split_step step;
+  do {
+    struct split_item *item = ring_peek(&stream->ring);
+    step = item->step;
+    switch (step) {
+    case SPLIT_RUN:
+      run_local(stream, &item->cmd, item->seq);
+      break;
+    case SPLIT_CROSS:
+      run_cross(stream, item->cross, item->seq);
+      break;
+    case SPLIT_SYNC:
+    case SPLIT_STOP:
+      // the job thread applies the log at the barrier
+      clear_held(stream);
+      if (output_flush(&stream->out)) {
+        stream->failed = 1;
+      }
+      pthread_barrier_wait(stream->barrier);
+      break;
+    }
+    ring_release(&stream->ring);
+  } while (step != SPLIT_STOP);
+  return NULL;
+}
 
-        if (kvs_delete(num_pairs, keys, output_fd)) {
-          fprintf(stderr, "Failed to delete pair\n");
-        }
-        break;
+// Hands a step to a stream.
+// @return The item's command, for SPLIT_RUN to fill in before publishing.
+struct split_item *push_step(struct split_stream *stream, enum split_step step,
+                             size_t seq, struct split_cross *cross) {
+  struct split_item *item = ring_reserve(&stream->ring);
+  item->step = step;
+  item->seq = seq;
+  item->cross = cross;
+  return item;
+}
 
-      case CMD_SHOW:
+// Bytes a WRITE or DELETE takes in the log, keeping the next one aligned.
+size_t logged_size(enum Command command, size_t num_pairs) {
+  size_t size = sizeof(struct split_logged) +
+                num_pairs * MAX_STRING_SIZE * (command == CMD_WRITE ? 2 : 1);
+  size_t align = _Alignof(struct split_logged);
+  return (size + align - 1) / align * align;
+}
 
-        kvs_show(output_fd);
-        break;
+// Adds a WRITE or DELETE to the log the job thread applies at the next sync.
+// @return 0 on success, 1 if there was no memory for it.
+int log_command(struct split_job *job, const struct job_command *cmd) {
+  size_t size = logged_size(cmd->command, cmd->num_pairs);
+  if (job->log_used + size > job->log_capacity) {
+    size_t capacity = job->log_capacity ? job->log_capacity : 64 * 1024;
+    while (capacity < job->log_used + size) {
+      capacity *= 2;
+    }
+    char *log = realloc(job->log, capacity);
+    if (!log) {
+      return 1;
+    }
+    job->log = log;
+    job->log_capacity = capacity;
+  }
+  struct split_logged *entry = (struct split_logged *)(job->log + job->log_used);
+  entry->command = cmd->command;
+  entry->num_pairs = cmd->num_pairs;
+  char *pairs = (char *)(entry + 1);
+  memcpy(pairs, cmd->keys, cmd->num_pairs * MAX_STRING_SIZE);
+  if (cmd->command == CMD_WRITE) {
+    memcpy(pairs + cmd->num_pairs * MAX_STRING_SIZE, cmd->values,
+           cmd->num_pairs * MAX_STRING_SIZE);
+  }
+  job->log_used += size;
+  return 0;
+}
 
-      case CMD_WAIT:
-        if (parse_wait(input_fd, &delay, NULL) == -1) {
-          fprintf(stderr, "Invalid command. See HELP for usage\n");
-          continue;
-        }
+// Applies the logged WRITEs and DELETEs to the table one by one, as the job
+// would have run them whole. Their replies were written by the streams.
+void apply_log(struct split_job *job) {
+  size_t pos = 0;
+  while (pos < job->log_used) {
+    struct split_logged *entry = (struct split_logged *)(job->log + pos);
+    char(*keys)[MAX_STRING_SIZE] = (char(*)[MAX_STRING_SIZE])(entry + 1);
+    if (entry->command == CMD_WRITE) {
+      char(*values)[MAX_STRING_SIZE] = keys + entry->num_pairs;
+      if (job->batch ? kvs_batch_write(job->batch, entry->num_pairs, keys, values)
+                     : kvs_write(entry->num_pairs, keys, values)) {
+        fprintf(stderr, "Failed to write pair\n");
+      }
+    } else if (job->batch ? kvs_batch_delete(job->batch, entry->num_pairs, keys, NULL)
+                          : kvs_delete(entry->num_pairs, keys, NULL)) {
+      fprintf(stderr, "Failed to delete pair\n");
+    }
+    pos += logged_size(entry->command, entry->num_pairs);
+  }
+  job->log_used = 0;
+}
 
-        if (delay > 0) {
-          char *buf = "Waiting...\n";
-          write(output_fd, buf, strlen(buf));
-          kvs_wait(delay);
-        }
-        break;
+// Writes the output held by the streams in job order and empties their
+// memory files. Every stream is waiting at the barrier.
+void merge_output(struct split_job *job, OutputBuffer *out) {
+  char *maps[SPLIT_MAX_STREAMS];
+  size_t next[SPLIT_MAX_STREAMS], start[SPLIT_MAX_STREAMS];
+  for (int i = 0; i < job->streams; i++) {
+    struct split_stream *stream = &job->stream[i];
+    size_t size = stream->out.written;
+    maps[i] = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, stream->out_fd, 0)
+                       : NULL;
+    if (maps[i] == MAP_FAILED) {
+      maps[i] = NULL;
+      stream->failed = 1;
+    }
+    next[i] = 0;
+    start[i] = 0;
+  }
 
-      case CMD_BACKUP:
-        file.process_count++;
-        file.backup_count++;
-        
-        if(file.process_count > max_backups) {
-          wait(NULL);
-          file.process_count--;
-        }
-        
-        pid_t pid = fork();
-        if (pid == 0) {
-          kvs_backup(input_path, file.backup_count);
-          exit(0);
-        } else if (pid < 0) {
-          fprintf(stderr, "Failed to create backup\n"); 
-          break;
-          
-        } else {
-          break;
-        }
-        break;
+  while (1) {
+    int first = -1;
+    for (int i = 0; i < job->streams; i++) {
+      if (next[i] < job->stream[i].num_marks &&
+          (first == -1 || job->stream[i].marks[next[i]].seq <
+                              job->stream[first].marks[next[first]].seq)) {
+        first = i;
+      }
+    }
+    if (first == -1) {
+      break;
+    }
+    size_t end = job->stream[first].marks[next[first]++].end;
+    if (maps[first] != NULL) {
+      output_write(out, maps[first] + start[first], end - start[first]);
+    }
+    start[first] = end;
+  }
 
-      case CMD_INVALID:
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-        break;
+  for (int i = 0; i < job->streams; i++) {
+    struct split_stream *stream = &job->stream[i];
+    if (maps[i] != NULL) {
+      munmap(maps[i], stream->out.written);
+    }
+    if (ftruncate(stream->out_fd, 0) != 0 ||
+        lseek(stream->out_fd, 0, SEEK_SET) != 0) {
+      stream->failed = 1;
+    }
+    stream->out.written = 0;
+    stream->num_marks = 0;
+    if (stream->failed) {
+      fprintf(stderr, "Failed to write output: %s\n", strerror(errno));
+      stream->failed = 0;
+    }
+  }
+}
+
+// Waits for every stream to run what it was given, then merges their output
+// and applies the log.
+void sync_streams(struct split_job *job, OutputBuffer *out, enum split_step step) {
+  for (int i = 0; i < job->streams; i++) {
+    push_step(&job->stream[i], step, 0, NULL);
+    ring_publish(&job->stream[i].ring);
+  }
+  pthread_barrier_wait(&job->barrier);
+  merge_output(job, out);
+  apply_log(job);
+  atomic_store(&job->full, 0);
+}
+
+// Hands a WRITE, READ or DELETE to the streams owning its keys, and logs a
+// WRITE or DELETE for the next sync.
+// @return 0 on success, 1 if the command was left for the caller to run.
+int dispatch_command(struct split_job *job, struct job_command *cmd, size_t seq) {
+  unsigned char owner[MAX_WRITE_SIZE];
+  int count[SPLIT_MAX_STREAMS] = {0};
+  int parties = 0;
+  for (size_t i = 0; i < cmd->num_pairs; i++) {
+    owner[i] = (unsigned char)stream_of(cmd->keys[i], job->streams);
+    if (count[owner[i]]++ == 0) {
+      parties++;
+    }
+  }
 
-      case CMD_HELP: {
-        char *buf = "Available commands:\n  WRITE [(key,value)(key2,value2),...]\n"
-                    "  READ [key,key2,...]\n"
-                    "  DELETE [key,key2,...]\n"
-                    "  SHOW\n"
-                    "  WAIT <delay_ms>\n"
-                    "  BACKUP\n" // Not implemented
-                    "  HELP\n";
-        write(output_fd, buf, strlen(buf));
+  struct split_cross *cross = NULL;
+  if (parties > 1) {
+    cross = malloc(sizeof(struct split_cross));
+    if (!cross) {
+      return 1;
+    }
+  }
+  if (cmd->command != CMD_READ && log_command(job, cmd) != 0) {
+    free(cross);
+    return 1;
+  }
 
+  if (parties == 1) {
+    struct split_item *item = push_step(&job->stream[owner[0]], SPLIT_RUN, seq, NULL);
+    copy_command(&item->cmd, cmd);
+    ring_publish(&job->stream[owner[0]].ring);
+    return 0;
+  }
+
+  copy_command(&cross->cmd, cmd);
+  memcpy(cross->owner, owner, cmd->num_pairs);
+  atomic_init(&cross->left, parties);
+  for (int s = 0; s < job->streams; s++) {
+    if (count[s] > 0) {
+      push_step(&job->stream[s], SPLIT_CROSS, seq, cross);
+      ring_publish(&job->stream[s].ring);
+    }
+  }
+  return 0;
+}
+
+// Frees streams from..to-1 of a job, whose threads exited or never started.
+void free_streams(struct split_job *job, int from, int to) {
+  for (int i = from; i < to; i++) {
+    struct split_stream *stream = &job->stream[i];
+    ring_destroy(&stream->ring);
+    output_close(&stream->out);
+    close(stream->out_fd);
+    free(stream->marks);
+    free(stream->held);
+  }
+}
+
+// Prepares the streams of a job.
+// @return Streams ready, 0 if not even one could be set up.
+int init_streams(struct split_job *job) {
+  int ready = 0;
+  for (; ready < split_streams; ready++) {
+    struct split_stream *stream = &job->stream[ready];
+    stream->held = calloc(SPLIT_HELD_SLOTS, sizeof(struct split_held));
+    if (!stream->held) {
+      break;
+    }
+    stream->out_fd = (int)syscall(SYS_memfd_create, "kvs-split", MFD_CLOEXEC);
+    if (stream->out_fd == -1) {
+      free(stream->held);
+      break;
+    }
+    if (ring_init(&stream->ring, sizeof(struct split_item), SPLIT_DEPTH) != 0) {
+      close(stream->out_fd);
+      free(stream->held);
+      break;
+    }
+    output_init(&stream->out, stream->out_fd);
+    stream->id = ready;
+    stream->failed = 0;
+    stream->marks = NULL;
+    stream->num_marks = 0;
+    stream->marks_capacity = 0;
+    stream->held_count = 0;
+    stream->held_mask = SPLIT_HELD_SLOTS - 1;
+    stream->full = &job->full;
+    stream->barrier = &job->barrier;
+  }
+  return ready;
+}
+
+// Whether a job is worth splitting among streams: long enough, and with few
+// enough of its first commands spanning several streams. Reads those commands
+// and rewinds the job.
+int worth_splitting(int input_fd) {
+  struct stat st;
+  if (split_streams == 0 || fstat(input_fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < SPLIT_MIN_SIZE) {
+    return 0;
+  }
+
+  struct job_command cmd;
+  size_t scanned = 0, spanning = 0;
+  while (scanned < SPLIT_SCAN_COMMANDS) {
+    if (!parse_command(input_fd, &cmd)) {
+      continue;
+    }
+    if (cmd.command == EOC) {
+      break;
+    }
+    if (cmd.command != CMD_WRITE && cmd.command != CMD_READ &&
+        cmd.command != CMD_DELETE) {
+      continue;
+    }
+    scanned++;
+    int first = stream_of(cmd.keys[0], split_streams);
+    for (size_t i = 1; i < cmd.num_pairs; i++) {
+      if (stream_of(cmd.keys[i], split_streams) != first) {
+        spanning++;
         break;
       }
-      case CMD_EMPTY:
+    }
+  }
+  forget_input(input_fd);
+  if (lseek(input_fd, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Failed to rewind job: %s\n", strerror(errno));
+    return 0;
+  }
+  return spanning * 100 <= scanned * SPLIT_MAX_SPANNING;
+}
+
+// Runs a job split among split_streams threads. Its output is the same as if
+// it ran whole, since each stream keeps the job order of its keys, the table
+// gets the writes in job order, and everything else waits at a barrier:
+// SHOW, SCAN, STATS, WAIT, BACKUP and HELP.
+// @return 0 once the job ran, 1 if the streams couldn't be set up and the
+// job wasn't started.
+int run_split_job(int input_fd, OutputBuffer *out, char input_path[],
+                  struct file_t *file, BackupChain *chain) {
+  struct split_job *job = malloc(sizeof(struct split_job));
+  if (!job) {
+    return 1;
+  }
+  job->batch = coalesced_jobs ? malloc(sizeof(WriteBatch)) : NULL;
+  if (job->batch != NULL) {
+    kvs_batch_init(job->batch);
+  }
+  int ready = init_streams(job);
+  int started = 0;
+  while (started < ready &&
+         pthread_create(&job->stream[started].thread, NULL, run_stream,
+                        &job->stream[started]) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    free_streams(job, 0, ready);
+    free(job->batch);
+    free(job);
+    return 1;
+  }
+  // streams left without a thread aren't used
+  free_streams(job, started, ready);
+  job->streams = started;
+  pthread_barrier_init(&job->barrier, NULL, (unsigned)started + 1);
+  atomic_init(&job->full, 0);
+  job->log = NULL;
+  job->log_used = 0;
+  job->log_capacity = 0;
+
+  struct job_command cmd;
+  size_t seq = 0, since_sync = 0;
+  while (1) {
+    read_command(input_fd, &cmd);
+    seq++;
+    switch (cmd.command) {
+    case CMD_WRITE:
+    case CMD_READ:
+    case CMD_DELETE:
+      if (dispatch_command(job, &cmd, seq) == 0) {
         break;
+      }
+      // no memory to split it, run it on its own
+      // fall through
+    case CMD_SHOW:
+    case CMD_SCAN:
+    case CMD_STATS:
+    case CMD_WAIT:
+    case CMD_BACKUP:
+    case CMD_HELP:
+      sync_streams(job, out, SPLIT_SYNC);
+      since_sync = 0;
+      run_command(&cmd, out, input_path, file, chain, job->batch);
+      break;
+
+    case CMD_INVALID:
+    case CMD_EMPTY:
+      run_command(&cmd, out, input_path, file, chain, job->batch);
+      break;
+
+    case EOC:
+      break;
+    }
+    if (cmd.command == EOC) {
+      break;
+    }
+    if (++since_sync == SPLIT_SYNC_INTERVAL || job->log_used >= SPLIT_LOG_SIZE ||
+        atomic_load(&job->full)) {
+      sync_streams(job, out, SPLIT_SYNC);
+      since_sync = 0;
+    }
+  }
+
+  sync_streams(job, out, SPLIT_STOP);
+  // applies what -c still holds
+  run_command(&cmd, out, input_path, file, chain, job->batch);
+  for (int i = 0; i < started; i++) {
+    pthread_join(job->stream[i].thread, NULL);
+  }
+  pthread_barrier_destroy(&job->barrier);
+  free_streams(job, 0, started);
+  free(job->log);
+  free(job->batch);
+  free(job);
+  return 0;
+}
+
+int kvs_processor(int input_fd, OutputBuffer *out, char input_path[], struct file_t file) {
+    BackupChain chain;
+    kvs_backup_chain_init(&chain);
+
+    // with -j a long job runs split by its keys over several threads
+    if (worth_splitting(input_fd) &&
+        run_split_job(input_fd, out, input_path, &file, &chain) == 0) {
+      kvs_backup_chain_end(&chain);
+      return 0;
+    }
+
+    // with -i commands are read by another thread while this one runs them
+    struct job_parser parser = {.input_fd = input_fd};
+    pthread_t parser_thread;
+    int pipelined = worth_pipelining(input_fd) &&
+                    ring_init(&parser.ring, sizeof(struct job_command),
+                              PIPELINE_DEPTH) == 0;
+    if (pipelined &&
+        pthread_create(&parser_thread, NULL, parse_job, &parser) != 0) {
+      ring_destroy(&parser.ring);
+      pipelined = 0;
+    }
 
-      case EOC:
-        return 0;
+    // with -c writes are held in a batch until something can observe them
+    WriteBatch *batch = coalesced_jobs ? malloc(sizeof(WriteBatch)) : NULL;
+    if (batch != NULL) {
+      kvs_batch_init(batch);
+    }
+
+    struct job_command local;
+    while (1) {
+      struct job_command *cmd = &local;
+
+      STATS_TIME(start);
+      if (pipelined) {
+        cmd = ring_peek(&parser.ring);
+      } else {
+        read_command(input_fd, cmd);
+      }
+      enum Command command = cmd->command;
+      run_command(cmd, out, input_path, &file, &chain, batch);
+      if (pipelined) {
+        ring_release(&parser.ring);
+      }
+      if (command == EOC) {
+        break;
       }
+      STATS_COMMAND(command, start);
+    }
+
+    if (pipelined) {
+      pthread_join(parser_thread, NULL);
+      ring_destroy(&parser.ring);
     }
+    free(batch);
+    kvs_backup_chain_end(&chain);
+    return 0;
   }
   
 
-void insert_to_end(struct file_t file){
-  if (q->head == NULL){
-    q->head = (q->tail = new_args(file, q->head));
-    return;
-  }
-  q->tail->next = new_args(file, q->tail->next);
-  q->tail = q->tail->next;
+// Whether a directory entry is a job file.
+int is_job_name(const char *name) {
+  const char *extension = strrchr(name, '.');
+  return extension != NULL && strcmp(extension, ".job") == 0;
+}
 
+// Queues a job for the threads, waiting while the queue is full.
+void enqueue_job(const char *name) {
+  STATS_LOCK(STAT_LOCK_QUEUE, pthread_mutex_trylock(&locker),
+             pthread_mutex_lock(&locker));
+  while (q.count >= queue_size) {
+    pthread_cond_wait(&space_cond, &locker);
+  }
+  STATS_HOLD_BEGIN(STAT_LOCK_QUEUE);
+  insert_to_end(name);
+  pthread_cond_signal(&queue_cond);
+  STATS_HOLD_END(STAT_LOCK_QUEUE);
+  pthread_mutex_unlock(&locker);
 }
-struct file_t get_and_delete(){
-  struct file_t file = q->head->file;
-  queue temp = q->head->next;
-  free(q->head);
-  q->head = temp;
-  return file;
+
+void remember_name(struct name_set *set, const char *name) {
+  if (set->count == set->capacity) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 64;
+    char **names = realloc(set->names, capacity * sizeof(char *));
+    if (!names)
+      return; // at worst the job runs twice
+    set->names = names;
+    set->capacity = capacity;
+  }
+  char *copy = strdup(name);
+  if (copy != NULL) {
+    set->names[set->count++] = copy;
+  }
 }
 
+int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
+// Reads the priority hint of a job: a first line "#PRIORITY <n>", which the
+// parser takes for a comment.
+// @return The priority, 0 if the job has no hint.
+long job_priority(int dir_fd, const char *name) {
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return 0;
+  }
+  char head[32];
+  ssize_t len = read(fd, head, sizeof(head) - 1);
+  close(fd);
+  size_t hint_len = strlen(PRIORITY_HINT);
+  if (len <= (ssize_t)hint_len || strncmp(head, PRIORITY_HINT, hint_len) != 0) {
+    return 0;
+  }
+  head[len] = '\0';
+  return strtol(head + hint_len, NULL, 10);
+}
 
-queue new_args (struct file_t file, queue next){
-  queue temp = malloc(sizeof(struct queue_node));
+// @return 0 on success, 1 if there was no memory for the job.
+int add_sized_job(struct job_list *list, const char *name, off_t size,
+                  long priority) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 256;
+    struct sized_job *jobs = realloc(list->jobs, capacity * sizeof(*jobs));
+    if (!jobs)
+      return 1;
+    list->jobs = jobs;
+    list->capacity = capacity;
+  }
+  size_t name_size = strlen(name) + 1;
+  if (list->names_len + name_size > list->names_capacity) {
+    size_t capacity = list->names_capacity ? list->names_capacity * 2 : 4096;
+    while (capacity < list->names_len + name_size) {
+      capacity *= 2;
+    }
+    char *names = realloc(list->names, capacity);
+    if (!names)
+      return 1;
+    list->names = names;
+    list->names_capacity = capacity;
+  }
+  memcpy(list->names + list->names_len, name, name_size);
+  list->jobs[list->count] = (struct sized_job){priority, size, list->names_len,
+                                               list->count};
+  list->count++;
+  list->names_len += name_size;
+  return 0;
+}
 
-  temp->file = file;
-  pthread_mutex_init(&temp->file.file_lock, NULL);
-  temp->next = next;
-  return temp;
-  
+// Higher priority first, then larger first, then directory order.
+int compare_sized_jobs(const void *a, const void *b) {
+  const struct sized_job *x = a, *y = b;
+  if (x->priority != y->priority)
+    return x->priority > y->priority ? -1 : 1;
+  if (x->size != y->size)
+    return x->size > y->size ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
 }
 
-void init_head_and_tail(){
-  q = malloc(sizeof(struct list));
-  q->head = NULL;
-  q->tail = NULL;
+// Queues every job of the list, longest processing time first: a thread
+// that takes a long job late would keep running after the others ran out of
+// work, while short jobs at the end fill the gaps. The list is freed here.
+void queue_longest_first(struct job_list *list) {
+  if (list->count > 0) {
+    qsort(list->jobs, list->count, sizeof(struct sized_job), compare_sized_jobs);
+  }
+  for (size_t i = 0; i < list->count; i++) {
+    enqueue_job(list->names + list->jobs[i].name);
+  }
+  free(list->jobs);
+  free(list->names);
 }
 
-int q_empty(){
-  return q->head == NULL;
+// First pass over the jobs directory. Entries are read in large batches with
+// getdents64 and only .job files are queued, each one as soon as it is read,
+// so a huge directory is never held in memory and its first jobs start right
+// away. With -o every job is listed with its size first, and queued by
+// queue_longest_first once the whole directory was read.
+// @param scanned In watch mode, gets the jobs changed since changed_since:
+// only those can still have events pending. NULL otherwise.
+// @return 0 on success, 1 if the directory couldn't be read.
+int scan_jobs(int dir_fd, struct name_set *scanned, time_t changed_since) {
+  char *buffer = malloc(DIRENT_BUFFER_SIZE);
+  if (!buffer) {
+    return 1;
+  }
+  int result = 0;
+  struct job_list found = {NULL, 0, 0, NULL, 0, 0};
+  long len;
+  while ((len = syscall(SYS_getdents64, dir_fd, buffer, DIRENT_BUFFER_SIZE)) > 0) {
+    for (long pos = 0; pos < len;) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *)(void *)(buffer + pos);
+      pos += entry->d_reclen;
+      // DT_UNKNOWN on filesystems that don't fill d_type
+      if ((entry->d_type != DT_REG && entry->d_type != DT_LNK &&
+           entry->d_type != DT_UNKNOWN) ||
+          !is_job_name(entry->d_name)) {
+        continue;
+      }
+      struct stat st;
+      int have_stat = (scanned != NULL || longest_first) &&
+                      fstatat(dir_fd, entry->d_name, &st, 0) == 0;
+      if (scanned != NULL && have_stat && st.st_ctime + 1 >= changed_since) {
+        remember_name(scanned, entry->d_name);
+      }
+      if (!longest_first ||
+          add_sized_job(&found, entry->d_name, have_stat ? st.st_size : 0,
+                        job_priority(dir_fd, entry->d_name)) != 0) {
+        // without memory for the list the job just isn't reordered
+        enqueue_job(entry->d_name);
+      }
+    }
+  }
+  if (len < 0) {
+    fprintf(stderr, "Failed to read directory: %s\n", strerror(errno));
+    result = 1;
+  }
+  queue_longest_first(&found);
+  free(buffer);
+  return result;
 }
 
-void *thread_processer(void *arg){
-  pthread_mutex_lock(&locker);
-  Q args = (Q)arg;
-  pthread_mutex_unlock(&locker);
-  while (1){
-    pthread_mutex_lock(&locker);
-    if (!q_empty(args)){
-      
-      struct file_t file_arg = get_and_delete(args);
-      pthread_mutex_unlock(&locker);
-      if (strcmp(file_arg.name, ".") != 0 && strcmp(file_arg.name, "..") != 0 && strcmp(strrchr(file_arg.name, '.'), ".job") == 0) {
-        char input_path[MAX_JOB_FILE_NAME_SIZE] = "";
-        strcpy(input_path, file_arg.directory);
-        strcat(input_path, "/");
-        strcat(input_path, file_arg.name);
-        int input_fd = open(input_path, O_RDONLY);
-        if (input_fd == -1) {
-          fprintf(stderr, "Failed to open file: %s\n", strerror(errno));
-          return NULL;
+// Watch mode: queues every job closed after writing, or moved, into the
+// directory until SIGINT or SIGTERM. When the queue is full this stops
+// reading events, and the kernel holds them meanwhile.
+// @param watch_fd Non blocking inotify descriptor watching the directory.
+// @param signals Signals that stop the watch, blocked in every thread.
+// @param scanned Recent jobs queued by the first pass, freed here.
+// @return 0 once stopped by a signal, 1 on error.
+int watch_jobs(int watch_fd, const sigset_t *signals, struct name_set *scanned) {
+  int signal_fd = signalfd(-1, signals, SFD_CLOEXEC);
+  if (signal_fd == -1) {
+    fprintf(stderr, "Failed to wait for signals: %s\n", strerror(errno));
+    return 1;
+  }
+  if (scanned->count > 0) {
+    qsort(scanned->names, scanned->count, sizeof(char *), compare_names);
+  }
+
+  // aligned like the struct, so the events can be read in place
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd fds[2] = {{watch_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+  int result = 0;
+  // the first read only has events from before the pass ended, which may be
+  // for jobs it already queued
+  int first = 1;
+  while (1) {
+    ssize_t len = read(watch_fd, events, sizeof(events));
+    if (len > 0) {
+      for (char *pos = events; pos < events + len;) {
+        struct inotify_event *event = (struct inotify_event *)(void *)pos;
+        pos += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          fprintf(stderr, "Too many new jobs at once, some were missed\n");
+        }
+        if (event->len == 0 || !is_job_name(event->name)) {
+          continue;
         }
-        char output_path[MAX_JOB_FILE_NAME_SIZE] = "";
-        strncpy(output_path, input_path, strlen(input_path) - 4);
-        strcat(output_path, ".out");
-        int output_fd = open(output_path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IROTH | S_IRGRP);
-        if (output_fd == -1) {
-          fprintf(stderr, "Failed to open file: %s\n", strerror(errno));
-          return NULL;
+        const char *name = event->name;
+        if (first && scanned->count > 0 &&
+            bsearch(&name, scanned->names, scanned->count, sizeof(char *),
+                    compare_names) != NULL) {
+          continue;
         }
-        pthread_mutex_lock(&locker);
-        kvs_processor(input_fd, output_fd, input_path, file_arg);
-        pthread_mutex_unlock(&locker);
-        close(output_fd);
-        close(input_fd);
-      }  
-      pthread_mutex_lock(&locker);
-      file_counter--;
-      if(q_empty(args)){
-        pthread_mutex_unlock(&locker);
-        return NULL;
+        enqueue_job(event->name);
       }
-      pthread_mutex_unlock(&locker);
+      continue;
+    }
+    if (len == -1 && errno != EAGAIN && errno != EINTR) {
+      fprintf(stderr, "Failed to read directory events: %s\n", strerror(errno));
+      result = 1;
+      break;
     }
-    if(q_empty(args) && file_counter == 0){
-      pthread_mutex_unlock(&locker);
-      return NULL;
+
+    if (first) {
+      for (size_t i = 0; i < scanned->count; i++) {
+        free(scanned->names[i]);
+      }
+      free(scanned->names);
+      scanned->names = NULL;
+      scanned->count = 0;
+      first = 0;
+    }
+    if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+      result = 1;
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (read(signal_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+        fprintf(stderr, "Stopping after the queued jobs (signal %u)\n",
+                info.ssi_signo);
+      }
+      break;
     }
+  }
+
+  for (size_t i = 0; i < scanned->count; i++) {
+    free(scanned->names[i]);
+  }
+  free(scanned->names);
+  close(signal_fd);
+  return result;
+}
+
+void insert_to_end(const char *name){
+  char *slot = q.names[(q.head + q.count) % queue_size];
+  strncpy(slot, name, MAX_JOB_FILE_NAME_SIZE - 1);
+  slot[MAX_JOB_FILE_NAME_SIZE - 1] = '\0';
+  q.count++;
+}
+
+void get_and_delete(struct file_t *file){
+  strcpy(file->name, q.names[q.head]);
+  file->backup_count = 0;
+  q.head = (q.head + 1) % queue_size;
+  q.count--;
+}
+
+// @return 0 on success, 1 if there was no memory for the queue.
+int init_queue(){
+  q.names = malloc((size_t)queue_size * MAX_JOB_FILE_NAME_SIZE);
+  q.head = 0;
+  q.count = 0;
+  return q.names == NULL;
+}
+
+int q_empty(){
+  return q.count == 0;
+}
+
+// Signals that no more jobs will be queued. Threads exit once the queue is
+// empty.
+void close_queue(){
+  pthread_mutex_lock(&locker);
+  queue_closed = 1;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&locker);
+}
+
+// Blocks until there is a job to run.
+// @return 1 if a job was taken into file, 0 if the queue was closed and is
+// empty.
+int wait_for_job(struct file_t *file){
+  STATS_LOCK(STAT_LOCK_QUEUE, pthread_mutex_trylock(&locker),
+             pthread_mutex_lock(&locker));
+  while (q_empty() && !queue_closed){
+    pthread_cond_wait(&queue_cond, &locker);
+  }
+  if (q_empty()){
     pthread_mutex_unlock(&locker);
+    return 0;
+  }
+  STATS_HOLD_BEGIN(STAT_LOCK_QUEUE);
+  get_and_delete(file);
+  pthread_cond_signal(&space_cond);
+  STATS_HOLD_END(STAT_LOCK_QUEUE);
+  pthread_mutex_unlock(&locker);
+  return 1;
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Reports how much of the run each worker spent on jobs, one line per thread,
+// on stderr: "Thread <i>: <jobs> jobs, busy <s> of <s> s (<pct>%)".
+void print_usage(const struct thread_usage *workers, uint64_t elapsed_ns) {
+  double elapsed = (double)elapsed_ns / 1e9;
+  for (int i = 0; i < max_threads; i++) {
+    double busy = (double)workers[i].busy_ns / 1e9;
+    fprintf(stderr, "Thread %d: %u jobs, busy %.3f of %.3f s (%.1f%%)\n", i,
+            workers[i].jobs, busy, elapsed,
+            elapsed > 0 ? 100 * busy / elapsed : 0.0);
+  }
+}
+
+void *thread_processer(void *arg){
+  struct thread_usage *worker = arg;
+  struct file_t file_arg;
+  while (wait_for_job(&file_arg)){
+    uint64_t job_start = now_ns();
+    char input_path[MAX_JOB_FILE_NAME_SIZE] = "";
+    if (snprintf(input_path, sizeof(input_path), "%s/%s", jobs_directory,
+                 file_arg.name) >= (int)sizeof(input_path)) {
+      fprintf(stderr, "Job path too long: %s\n", file_arg.name);
+      continue;
+    }
+    int input_fd = open(input_path, O_RDONLY);
+    if (input_fd == -1) {
+      fprintf(stderr, "Failed to open file: %s\n", strerror(errno));
+      continue;
+    }
+    char output_path[MAX_JOB_FILE_NAME_SIZE] = "";
+    strncpy(output_path, input_path, strlen(input_path) - 4);
+    strcat(output_path, ".out");
+    int output_fd = open(output_path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IROTH | S_IRGRP);
+    if (output_fd == -1) {
+      fprintf(stderr, "Failed to open file: %s\n", strerror(errno));
+      close(input_fd);
+      continue;
+    }
+    OutputBuffer out;
+    output_init(&out, output_fd);
+    kvs_processor(input_fd, &out, input_path, file_arg);
+    if (output_close(&out)) {
+      fprintf(stderr, "Failed to write output: %s\n", strerror(errno));
+    }
+    close(output_fd);
+    forget_input(input_fd);
+    close(input_fd);
+    worker->jobs++;
+    worker->busy_ns += now_ns() - job_start;
   }
   return NULL;
 }
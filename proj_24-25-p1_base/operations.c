@@ -4,12 +4,52 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <errno.h>
 
 #include "constants.h"
 #include "kvs.h"
+#include "operations.h"
+#include "output.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "wal.h"
 
 static struct HashTable *kvs_table = NULL;
 
+// Backups between two full checkpoints, 0 when every backup is full.
+static unsigned int checkpoint_interval = 0;
+
+// Whether backups are written as binary snapshots instead of text.
+static int binary_backups = 0;
+
+// Whether SHOW and text backups follow key order instead of bucket order.
+static int sorted_output = 0;
+
+// Threads that format a SHOW, backup or checkpoint.
+static unsigned int dump_threads = 1;
+
+// Write-ahead log and the checkpoint that holds everything before it, when
+// the log is enabled.
+static char wal_path[MAX_JOB_FILE_NAME_SIZE] = "";
+static char checkpoint_path[MAX_JOB_FILE_NAME_SIZE + 8] = "";
+
+static int write_checkpoint();
+static int checkpoint_if_due();
+
+// Chains of the running jobs, to know the oldest version a delta still needs
+// deletions from.
+static BackupChain *chains = NULL;
+static pthread_mutex_t chains_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Backups share one <max backup> limit across every job, so a job only
+// waits in BACKUP while that many backups are being written.
+static pthread_mutex_t backups_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backups_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int max_backups = 1;
+static unsigned int running_backups = 0;
+
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
@@ -24,18 +64,78 @@ int kvs_init() {
   }
 
   kvs_table = create_hash_table();
-  pthread_mutex_init(&kvs_table->locker_hashtable, NULL);
   return kvs_table == NULL;
 }
 
+int kvs_enable_deltas(unsigned int interval) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  checkpoint_interval = interval;
+  if (interval > 1) {
+    track_deletes(kvs_table);
+  }
+  return 0;
+}
+
+void kvs_enable_backups(unsigned int max) {
+  max_backups = max > 0 ? max : 1;
+}
+
+// Takes one of the max_backups slots, waiting while all are in use.
+static void reserve_backup() {
+  pthread_mutex_lock(&backups_lock);
+  while (running_backups >= max_backups) {
+    pthread_cond_wait(&backups_cond, &backups_lock);
+  }
+  running_backups++;
+  pthread_mutex_unlock(&backups_lock);
+}
+
+static void release_backup() {
+  pthread_mutex_lock(&backups_lock);
+  running_backups--;
+  pthread_cond_broadcast(&backups_cond);
+  pthread_mutex_unlock(&backups_lock);
+}
+
+void kvs_wait_backup() {
+  pthread_mutex_lock(&backups_lock);
+  while (running_backups > 0) {
+    pthread_cond_wait(&backups_cond, &backups_lock);
+  }
+  pthread_mutex_unlock(&backups_lock);
+}
+
+void kvs_enable_snapshots() {
+  binary_backups = 1;
+}
+
+void kvs_enable_sorted_output() {
+  sorted_output = 1;
+}
+
+void kvs_enable_parallel_dump(unsigned int threads) {
+  dump_threads = threads < 1                  ? 1
+                 : threads > DUMP_MAX_THREADS ? DUMP_MAX_THREADS
+                                              : threads;
+}
+
 int kvs_terminate() {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  pthread_mutex_destroy(&kvs_table->locker_hashtable);
+  kvs_wait_backup();
+  int result = 0;
+  if (wal_path[0] != '\0') {
+    // every job is done, so the log can be folded into a checkpoint
+    result = write_checkpoint();
+    wal_close();
+  }
   free_table(kvs_table);
-  return 0;
+  return result;
 }
 
 //modificado
@@ -43,152 +143,1024 @@ int kvs_terminate() {
 typedef struct KeyValuePair {
     char key[MAX_STRING_SIZE];
     char value[MAX_STRING_SIZE];
+    size_t order; // position in the command, breaks ties between equal keys
 } KeyValuePair;
 
+// Longest reply of a READ, "[(key,value)...]\n" for MAX_WRITE_SIZE keys.
+#define READ_REPLY_SIZE (MAX_WRITE_SIZE * (2 * MAX_STRING_SIZE + 3) + 3)
+// Longest reply of a DELETE, "[(key,KVSMISSING)...]\n".
+#define DELETE_REPLY_SIZE (MAX_WRITE_SIZE * (MAX_STRING_SIZE + 13) + 3)
+
+// Appends str to a reply of len bytes in a buffer of size bytes, keeping it
+// NUL terminated. What doesn't fit is left out.
+static void reply_append(char *reply, size_t *len, size_t size,
+                         const char *str) {
+  size_t n = strnlen(str, size - *len - 1);
+  memcpy(reply + *len, str, n);
+  *len += n;
+  reply[*len] = '\0';
+}
+
+// Writes the reply of a DELETE: "[(key,KVSMISSING)...]" with the keys it
+// didn't find, in command order, or nothing if it found them all or out is
+// NULL.
+// @param missing missing[i] is set if keys[i] wasn't there.
+static void output_missing(OutputBuffer *out, size_t num_pairs,
+                           char keys[][MAX_STRING_SIZE], const int *missing) {
+  if (out == NULL) {
+    return;
+  }
+  char reply[DELETE_REPLY_SIZE];
+  size_t len = 0;
+  reply[0] = '\0';
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (missing[i]) {
+      reply_append(reply, &len, sizeof(reply), len == 0 ? "[(" : "(");
+      reply_append(reply, &len, sizeof(reply), keys[i]);
+      reply_append(reply, &len, sizeof(reply), ",KVSMISSING)");
+    }
+  }
+  if (len > 0) {
+    reply_append(reply, &len, sizeof(reply), "]\n");
+    output_write(out, reply, len);
+  }
+}
+
 //funcao auxiliar que compara 
 int compareKeyValuePairs(const void *a, const void *b) {
     KeyValuePair *pairA = (KeyValuePair *)a;
     KeyValuePair *pairB = (KeyValuePair *)b;
-    return strcmp(pairA->key, pairB->key);
+    int cmp = strcmp(pairA->key, pairB->key);
+    if (cmp != 0) {
+      return cmp;
+    }
+    return (pairA->order > pairB->order) - (pairA->order < pairB->order);
 }
 
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
-  pthread_mutex_lock(&kvs_table->locker_hashtable);
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
-    pthread_mutex_unlock(&kvs_table->locker_hashtable);
     return 1;
   }
-  pthread_mutex_unlock(&kvs_table->locker_hashtable);
   
   // cria a estrutura auxiliar
   KeyValuePair pairs[num_pairs];
   for (size_t i = 0; i < num_pairs; i++) {
     strncpy(pairs[i].key, keys[i], MAX_STRING_SIZE);
     strncpy(pairs[i].value, values[i], MAX_STRING_SIZE);
+    pairs[i].order = i;
   }
   //ordena a lista por ordem alfabetica
+  // equal keys keep the command's order, so the last of each group wins
   qsort(pairs, num_pairs, sizeof(KeyValuePair), compareKeyValuePairs);
 
 
+  // every pair is written with all its stripes locked at once, so no other
+  // job sees the WRITE half applied. Each stripe is locked only once, in
+  // order, so commands with keys in common can't deadlock
+  StripeSet stripes = {0};
   for (size_t i = 0; i < num_pairs; i++) {
-    pthread_mutex_lock(&kvs_table->locker_hashtable);
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
-      pthread_mutex_unlock(&kvs_table->locker_hashtable);
+    stripe_set_add(kvs_table, &stripes, pairs[i].key);
+  }
+  lock_stripes(kvs_table, &stripes, 1);
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (i + 1 < num_pairs && strcmp(pairs[i].key, pairs[i + 1].key) == 0) {
+      continue; // written by a later pair of the same command
+    }
+    if (write_pair(kvs_table, pairs[i].key, pairs[i].value) != 0) {
+      fprintf(stderr, "Failed to write keypair (%s,%s)\n", pairs[i].key,
+              pairs[i].value);
+    }
+  }
+  uint64_t lsn = wal_append(WAL_WRITE, num_pairs, keys, values);
+  unlock_stripes(kvs_table, &stripes);
+
+  // waits outside the stripes, along with other jobs' commands
+  int result = lsn != 0 && wal_wait(lsn);
+  return checkpoint_if_due() || result;
+}
+
+// Writes the reply of a READ, "[(key,value)...]" sorted by key. Keys with
+// held[i] set take values[i], or KVSERROR if the job deleted them; the
+// others are read from the table, all at the same point in time.
+static void read_reply(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_STRING_SIZE],
+                       const unsigned char *held, OutputBuffer *out) {
+  StripeSet stripes = {0};
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (held == NULL || held[i] == HELD_NONE) {
+      stripe_set_add(kvs_table, &stripes, keys[i]);
+    }
+  }
+
+  KeyValuePair pairs[num_pairs];  //cria a estrutura auxiliar
+  // reads without locks; if a WRITE touches the stripes meanwhile, reads again
+  ReadGuard guard = {0};
+  do {
+    read_begin(kvs_table, &stripes, &guard);
+    for (size_t i = 0; i < num_pairs; i++) {
+      strncpy(pairs[i].key, keys[i], MAX_STRING_SIZE);
+      pairs[i].order = i;
+      if (held != NULL && held[i] == HELD_VALUE) {
+        strcpy(pairs[i].value, values[i]);
+      } else if ((held != NULL && held[i] == HELD_DELETED) ||
+                 read_pair_into(kvs_table, keys[i], pairs[i].value,
+                                MAX_STRING_SIZE)) {
+        strcpy(pairs[i].value, "KVSERROR");
+      }
     }
-    pthread_mutex_unlock(&kvs_table->locker_hashtable);
+  } while (read_end(kvs_table, &stripes, &guard));
+
+  //sort da lista de estruturas auxiliares
+  qsort(pairs, num_pairs, sizeof(KeyValuePair), compareKeyValuePairs);
+
+  char final[READ_REPLY_SIZE] = "[";
+  size_t len = 1;
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    reply_append(final, &len, sizeof(final), "(");
+    reply_append(final, &len, sizeof(final), pairs[i].key);
+    reply_append(final, &len, sizeof(final), ",");
+    reply_append(final, &len, sizeof(final), pairs[i].value);
+    reply_append(final, &len, sizeof(final), ")");
+    //alteracao tirei o if
   }
 
+  reply_append(final, &len, sizeof(final), "]\n");
+  output_write(out, final, len);
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  read_reply(num_pairs, keys, NULL, NULL, out);
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int output_fd) {
-  pthread_mutex_lock(&kvs_table->locker_hashtable);
+int kvs_read_held(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                  char values[][MAX_STRING_SIZE], const unsigned char *held,
+                  OutputBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
-    pthread_mutex_unlock(&kvs_table->locker_hashtable);
     return 1;
-    
   }
-  pthread_mutex_unlock(&kvs_table->locker_hashtable);
+  read_reply(num_pairs, keys, values, held, out);
+  return 0;
+}
 
-  KeyValuePair pairs[num_pairs];  //cria a estrutura auxiliar
+int kvs_delete_reply(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                     const unsigned char *held, OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  StripeSet stripes = {0};
   for (size_t i = 0; i < num_pairs; i++) {
-    strncpy(pairs[i].key, keys[i], MAX_STRING_SIZE);
-    pthread_mutex_lock(&kvs_table->locker_hashtable);
-    char *result = read_pair(kvs_table, keys[i]);
-    pthread_mutex_unlock(&kvs_table->locker_hashtable);
-    if (result) {
-      strncpy(pairs[i].value, result, MAX_STRING_SIZE);
-      free(result);
-    } else {
-      strcpy(pairs[i].value, "KVSERROR");
+    if (held[i] == HELD_NONE) {
+      stripe_set_add(kvs_table, &stripes, keys[i]);
     }
   }
 
-  //sort da lista de estruturas auxiliares
+  int missing[num_pairs];
+  char value[MAX_STRING_SIZE];
+  ReadGuard guard = {0};
+  do {
+    read_begin(kvs_table, &stripes, &guard);
+    for (size_t i = 0; i < num_pairs; i++) {
+      missing[i] = held[i] == HELD_DELETED ||
+                   (held[i] == HELD_NONE &&
+                    read_pair_into(kvs_table, keys[i], value, sizeof(value)));
+    }
+  } while (read_end(kvs_table, &stripes, &guard));
+  output_missing(out, num_pairs, keys, missing);
+  return 0;
+}
+
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  int missing[num_pairs];
+
+  StripeSet stripes = {0};
+  for (size_t i = 0; i < num_pairs; i++) {
+    stripe_set_add(kvs_table, &stripes, keys[i]);
+  }
+
+  lock_stripes(kvs_table, &stripes, 1);
+  for (size_t i = 0; i < num_pairs; i++) {
+    missing[i] = delete_pair(kvs_table, keys[i]) != 0;
+  }
+  uint64_t lsn = wal_append(WAL_DELETE, num_pairs, keys, NULL);
+  unlock_stripes(kvs_table, &stripes);
+  output_missing(out, num_pairs, keys, missing);
+
+  int result = lsn != 0 && wal_wait(lsn);
+  return checkpoint_if_due() || result;
+}
+
+void kvs_batch_init(WriteBatch *batch) {
+  batch->count = 0;
+  batch->next_order = 0;
+  memset(batch->index, 0, sizeof(batch->index));
+}
+
+// Looks a key up in a batch.
+// @param slot If not NULL, set to the key's index slot, or to the free slot
+// where it goes.
+// @return Entry of the key, NULL if the batch doesn't hold it.
+static struct BatchEntry *batch_find(WriteBatch *batch, const char *key,
+                                     uint16_t **slot) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *c = key; *c != '\0'; c++) {
+    h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+  }
+  // the index has twice the slots of the entries, so one is always free
+  size_t mask = 2 * WRITE_BATCH_SIZE - 1;
+  for (size_t i = h & mask;; i = (i + 1) & mask) {
+    uint16_t entry = batch->index[i];
+    if (entry == 0 || strcmp(batch->entries[entry - 1].key, key) == 0) {
+      if (slot)
+        *slot = &batch->index[i];
+      return entry ? &batch->entries[entry - 1] : NULL;
+    }
+  }
+}
+
+int kvs_batch_write(WriteBatch *batch, size_t num_pairs,
+                    char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE]) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+  int result = 0;
+  if (batch->count + num_pairs > WRITE_BATCH_SIZE) {
+    result = kvs_batch_flush(batch);
+  }
+
+  // same order as kvs_write, so new keys enter the table in the same order
+  KeyValuePair pairs[num_pairs];
+  for (size_t i = 0; i < num_pairs; i++) {
+    strncpy(pairs[i].key, keys[i], MAX_STRING_SIZE);
+    strncpy(pairs[i].value, values[i], MAX_STRING_SIZE);
+    pairs[i].order = i;
+  }
   qsort(pairs, num_pairs, sizeof(KeyValuePair), compareKeyValuePairs);
 
-  char final[MAX_WRITE_SIZE] = "[";
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (i + 1 < num_pairs && strcmp(pairs[i].key, pairs[i + 1].key) == 0) {
+      continue; // written by a later pair of the same command
+    }
+    uint16_t *slot;
+    struct BatchEntry *entry = batch_find(batch, pairs[i].key, &slot);
+    if (entry == NULL) {
+      entry = &batch->entries[batch->count++];
+      *slot = (uint16_t)batch->count;
+      strcpy(entry->key, pairs[i].key);
+      entry->deleted = 0;
+      entry->reinsert = 0;
+      entry->order = batch->next_order++;
+    } else if (entry->deleted) {
+      entry->deleted = 0;
+      entry->reinsert = 1;
+      entry->order = batch->next_order++;
+    }
+    strcpy(entry->value, pairs[i].value);
+  }
+  return result;
+}
 
+int kvs_batch_read(WriteBatch *batch, size_t num_pairs,
+                   char keys[][MAX_STRING_SIZE], OutputBuffer *out) {
+  int result = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    strcat(final, "(");
-    strcat(final, pairs[i].key);
-    strcat(final, ",");
-    strcat(final, pairs[i].value);
-    strcat(final, ")");
-    //alteracao tirei o if
+    if (batch_find(batch, keys[i], NULL) != NULL) {
+      result = kvs_batch_flush(batch);
+      break;
+    }
   }
+  return kvs_read(num_pairs, keys, out) || result;
+}
 
-  strcat(final, "]\n");
-  write(output_fd, final, strlen(final));
+int kvs_batch_delete(WriteBatch *batch, size_t num_pairs,
+                     char keys[][MAX_STRING_SIZE], OutputBuffer *out) {
+  // deltas list deletions in the order the table saw them
+  int held = checkpoint_interval <= 1;
+  for (size_t i = 0; held && i < num_pairs; i++) {
+    held = batch_find(batch, keys[i], NULL) != NULL;
+  }
+  if (!held) {
+    int result = kvs_batch_flush(batch);
+    return kvs_delete(num_pairs, keys, out) || result;
+  }
+
+  int missing[num_pairs];
+  for (size_t i = 0; i < num_pairs; i++) {
+    struct BatchEntry *entry = batch_find(batch, keys[i], NULL);
+    missing[i] = entry->deleted;
+    entry->deleted = 1;
+    entry->reinsert = 0;
+  }
+  output_missing(out, num_pairs, keys, missing);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int output_fd) {
-  pthread_mutex_lock(&kvs_table->locker_hashtable);
+static int compare_entries(const void *a, const void *b) {
+  uint64_t x = (*(struct BatchEntry *const *)a)->order;
+  uint64_t y = (*(struct BatchEntry *const *)b)->order;
+  return (x > y) - (x < y);
+}
+
+// Logs what a batch does to the table as one record, with the deletes and
+// writes in the order kvs_batch_flush applies them, so a crash can't leave
+// half of it. The caller holds the stripes of every key.
+// @return Sequence number of the record, 0 if the log is not open.
+static uint64_t log_batch(struct BatchEntry **entries, size_t count) {
+  if (wal_path[0] == '\0') {
+    return 0;
+  }
+  char types[2 * WRITE_BATCH_SIZE];
+  char keys[2 * WRITE_BATCH_SIZE][MAX_STRING_SIZE];
+  char values[2 * WRITE_BATCH_SIZE][MAX_STRING_SIZE];
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (entries[i]->deleted || entries[i]->reinsert) {
+      types[n] = WAL_DELETE;
+      strcpy(keys[n++], entries[i]->key);
+    }
+    if (!entries[i]->deleted) {
+      types[n] = WAL_WRITE;
+      strcpy(keys[n], entries[i]->key);
+      strcpy(values[n++], entries[i]->value);
+    }
+  }
+  return n > 0 ? wal_append_batch(n, types, keys, values) : 0;
+}
+
+int kvs_batch_flush(WriteBatch *batch) {
+  if (batch->count == 0) {
+    return 0;
+  }
+
+  struct BatchEntry *entries[WRITE_BATCH_SIZE];
+  StripeSet stripes = {0};
+  for (size_t i = 0; i < batch->count; i++) {
+    entries[i] = &batch->entries[i];
+    stripe_set_add(kvs_table, &stripes, entries[i]->key);
+  }
+  qsort(entries, batch->count, sizeof(entries[0]), compare_entries);
+
+  // all at once, like a WRITE with every pair
+  int result = 0;
+  lock_stripes(kvs_table, &stripes, 1);
+  for (size_t i = 0; i < batch->count; i++) {
+    struct BatchEntry *entry = entries[i];
+    if (entry->deleted || entry->reinsert) {
+      delete_pair(kvs_table, entry->key);
+    }
+    if (!entry->deleted &&
+        write_pair(kvs_table, entry->key, entry->value) != 0) {
+      fprintf(stderr, "Failed to write keypair (%s,%s)\n", entry->key,
+              entry->value);
+      result = 1;
+    }
+  }
+  uint64_t lsn = log_batch(entries, batch->count);
+  unlock_stripes(kvs_table, &stripes);
+
+  kvs_batch_init(batch);
+  result = (lsn != 0 && wal_wait(lsn)) || result;
+  return checkpoint_if_due() || result;
+}
+
+struct show_args {
+  OutputBuffer *out;
+  uint64_t since; // only nodes written after this table version are shown
+};
+
+// Longest text a pair can take, as a "(key, value)" line or a snapshot
+// record.
+#define PAIR_TEXT_SIZE (2 * MAX_STRING_SIZE + 8)
+
+// Fewest pairs worth handing to a dump thread of their own.
+#define DUMP_MIN_PART_PAIRS 8192
+
+// Formats a node as "(key, value)\n" into buf, which holds PAIR_TEXT_SIZE
+// bytes.
+// @return Length of the line.
+static size_t format_text(const KeyNode *keyNode, char *buf) {
+  size_t key_len = strlen(keyNode->key);
+  size_t value_len = strlen(keyNode->value);
+  buf[0] = '(';
+  memcpy(buf + 1, keyNode->key, key_len);
+  memcpy(buf + 1 + key_len, ", ", 2);
+  memcpy(buf + 3 + key_len, keyNode->value, value_len);
+  memcpy(buf + 3 + key_len + value_len, ")\n", 2);
+  return key_len + value_len + 5;
+}
+
+// Writes a node as "(key, value)".
+static void show_pair(const KeyNode *keyNode, void *arg) {
+  struct show_args *args = arg;
+  if (keyNode->version <= args->since) {
+    return;
+  }
+  char line[PAIR_TEXT_SIZE];
+  output_write(args->out, line, format_text(keyNode, line));
+}
+
+// A SHOW, backup or checkpoint cut in parts. Threads format the parts into
+// memory at the same time and they are written out in order, so the result
+// is the same as formatting everything on one thread.
+struct dump {
+  size_t parts;
+  uint64_t since;           // only pairs written after this version go in
+  OutputBuffer *out;        // "(key, value)" lines go here,
+  SnapshotWriter *writer;   // or snapshot records here when set
+  TableView *view;          // pairs come from the stripes of this view,
+  const KeyNode **nodes;    // or from this list,
+  size_t num_nodes;         // or from the table when neither is set
+};
+
+// One part of a dump, formatted by its own thread.
+struct dump_part {
+  struct dump *dump;
+  size_t index;
+  char *data;
+  size_t len;
+  size_t capacity;
+  int started;   // the thread is running
+  int no_memory; // data holds only part of the pairs
+  pthread_t thread;
+};
+
+// Formats a pair the way the dump needs it into buf, which holds
+// PAIR_TEXT_SIZE bytes.
+// @return Bytes written, 0 if the pair is left out.
+static size_t format_pair(const struct dump *dump, const KeyNode *keyNode,
+                          char *buf) {
+  if (keyNode->version <= dump->since) {
+    return 0;
+  }
+  if (dump->writer != NULL) {
+    return snapshot_record(buf, keyNode->key, keyNode->value);
+  }
+  return format_text(keyNode, buf);
+}
+
+static void emit(struct dump *dump, const char *buf, size_t len) {
+  if (dump->writer != NULL) {
+    snapshot_write(dump->writer, buf, len);
+  } else {
+    output_write(dump->out, buf, len);
+  }
+}
+
+// Writes a pair straight to the dump's output.
+static void emit_pair(const KeyNode *keyNode, void *arg) {
+  char buf[PAIR_TEXT_SIZE];
+  emit(arg, buf, format_pair(arg, keyNode, buf));
+}
+
+// Formats a pair at the end of a part.
+static void buffer_pair(const KeyNode *keyNode, void *arg) {
+  struct dump_part *part = arg;
+  if (part->no_memory) {
+    return;
+  }
+  if (part->capacity - part->len < PAIR_TEXT_SIZE) {
+    size_t capacity = part->capacity ? part->capacity * 2 : OUTPUT_CHUNK_SIZE;
+    char *data = realloc(part->data, capacity);
+    if (!data) {
+      part->no_memory = 1;
+      return;
+    }
+    part->data = data;
+    part->capacity = capacity;
+  }
+  part->len += format_pair(part->dump, keyNode, part->data + part->len);
+}
+
+// Calls visit on the pairs of one part of a dump.
+static void walk_part(struct dump *dump, size_t index, pair_visitor visit,
+                      void *arg) {
+  if (dump->view != NULL) {
+    view_visit_buckets(dump->view, index, dump->parts, visit, arg);
+    return;
+  }
+  if (dump->nodes != NULL) {
+    size_t last = dump->num_nodes * (index + 1) / dump->parts;
+    for (size_t i = dump->num_nodes * index / dump->parts; i < last; i++) {
+      visit(dump->nodes[i], arg);
+    }
+    return;
+  }
+  visit_buckets(kvs_table, index, dump->parts, visit, arg);
+}
+
+static void *dump_thread(void *arg) {
+  struct dump_part *part = arg;
+  walk_part(part->dump, part->index, buffer_pair, part);
+  return NULL;
+}
+
+// Writes every pair of a dump, with one thread for each DUMP_MIN_PART_PAIRS
+// pairs up to dump_threads. The table or the captured view is held by the
+// caller.
+// @param pairs Roughly how many pairs the dump has.
+static void run_dump(struct dump *dump, size_t pairs) {
+  size_t parts = pairs / DUMP_MIN_PART_PAIRS;
+  dump->parts = parts < 1 ? 1 : parts > dump_threads ? dump_threads : parts;
+
+  struct dump_part helpers[DUMP_MAX_THREADS];
+  for (size_t i = 1; i < dump->parts; i++) {
+    helpers[i] = (struct dump_part){.dump = dump, .index = i};
+    helpers[i].started =
+        pthread_create(&helpers[i].thread, NULL, dump_thread, &helpers[i]) == 0;
+  }
+
+  // the first part goes straight out while the others are formatted
+  walk_part(dump, 0, emit_pair, dump);
+  for (size_t i = 1; i < dump->parts; i++) {
+    struct dump_part *part = &helpers[i];
+    if (part->started) {
+      pthread_join(part->thread, NULL);
+    }
+    if (!part->started || part->no_memory) {
+      walk_part(dump, i, emit_pair, dump); // format it here instead
+    } else {
+      emit(dump, part->data, part->len);
+    }
+    free(part->data);
+  }
+}
+
+static void collect_node(const KeyNode *keyNode, void *arg) {
+  struct dump *dump = arg;
+  dump->nodes[dump->num_nodes++] = keyNode;
+}
+
+// Writes the pairs written after a version, the whole table for 0. The
+// caller holds it locked.
+static void show_table(OutputBuffer *out, uint64_t since) {
+  size_t count = atomic_load(&kvs_table->count);
+  struct dump dump = {.since = since, .out = out};
+  if (sorted_output && dump_threads > 1 && count >= 2 * DUMP_MIN_PART_PAIRS) {
+    // the index can only be walked in key order, so gather it first
+    dump.nodes = malloc(count * sizeof(KeyNode *));
+    if (dump.nodes != NULL) {
+      visit_range(kvs_table, NULL, NULL, collect_node, &dump);
+      run_dump(&dump, dump.num_nodes);
+      free(dump.nodes);
+      return;
+    }
+  }
+  if (sorted_output) {
+    struct show_args args = {out, since};
+    visit_range(kvs_table, NULL, NULL, show_pair, &args);
+  } else {
+    run_dump(&dump, count);
+  }
+}
+
+void kvs_show(OutputBuffer *out) {
+  lock_table(kvs_table, 0);
+  show_table(out, 0);
+  unlock_table(kvs_table);
+}
+
+void kvs_scan(const char *from, const char *to, OutputBuffer *out) {
+  struct show_args args = {out, 0};
+  lock_table(kvs_table, 0);
+  visit_range(kvs_table, from, to, show_pair, &args);
+  unlock_table(kvs_table);
+}
+
+// Chain lengths reported by STATS; longer chains share the last row.
+#define STATS_CHAIN_LENGTHS 9
+
+void kvs_stats(OutputBuffer *out) {
+#ifdef KVS_STATS
+  size_t lengths[STATS_CHAIN_LENGTHS];
+  lock_table(kvs_table, 0);
+  chain_lengths(kvs_table, lengths, STATS_CHAIN_LENGTHS);
+  unlock_table(kvs_table);
+  stats_print(out, lengths, STATS_CHAIN_LENGTHS);
+#else
+  output_puts(out, "Statistics are disabled, build with make STATS=1\n");
+#endif
+}
+
+// Writes the table to the checkpoint through a temporary file, so a crash
+// leaves either the old or the new checkpoint in place, and then drops from
+// the log the records the checkpoint holds. The table is only locked to open
+// a view of it, together with the position of the log that matches; the view
+// is written out and synced while the jobs go on.
+static int write_checkpoint() {
+  char tmp_path[MAX_JOB_FILE_NAME_SIZE + 16];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", checkpoint_path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to write checkpoint %s\n", tmp_path);
+    return 1;
+  }
+
+  TableView view;
+  lock_table(kvs_table, 0);
+  size_t count = atomic_load(&kvs_table->count);
+  uint64_t mark = wal_mark();
+  view_open(kvs_table, &view);
+  unlock_table(kvs_table);
+
+  OutputBuffer out;
+  SnapshotWriter writer;
+  output_init(&out, fd);
+  int failed = view_capture(kvs_table, &view);
+  struct dump dump = {.writer = &writer, .view = &view};
+  snapshot_begin(&writer, &out, count);
+  run_dump(&dump, count);
+  snapshot_end(&writer);
+  view_close(kvs_table, &view);
+
+  int result = output_close(&out) || fsync(fd) != 0 || failed;
+  close(fd);
+  if (result || rename(tmp_path, checkpoint_path) != 0 ||
+      sync_parent(checkpoint_path) != 0) {
+    fprintf(stderr, "Failed to write checkpoint %s\n", checkpoint_path);
+    return 1;
+  }
+  if (wal_discard(mark) != 0) {
+    fprintf(stderr, "Failed to trim log %s\n", wal_path);
+    return 1;
+  }
+  return 0;
+}
+
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Folds the log into a checkpoint once WAL_CHECKPOINT_BYTES were logged,
+// so it doesn't grow for as long as the program runs (-f). Called with no
+// stripe held; one thread does it while the others go on.
+static int checkpoint_if_due() {
+  if (wal_path[0] == '\0' || !wal_checkpoint_due() ||
+      pthread_mutex_trylock(&checkpoint_lock) != 0) {
+    return 0;
+  }
+  int result = wal_checkpoint_due() && write_checkpoint();
+  pthread_mutex_unlock(&checkpoint_lock);
+  return result;
+}
+
+int kvs_enable_wal(const char *path, unsigned int commit_delay_us) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
-    pthread_mutex_unlock(&kvs_table->locker_hashtable);
     return 1;
   }
-  pthread_mutex_unlock(&kvs_table->locker_hashtable);
-  char final[MAX_WRITE_SIZE] = "";
-  int aux = 0;
-  
-  for (size_t i = 0; i < num_pairs; i++) {
-    pthread_mutex_lock(&kvs_table->locker_hashtable);
-    if (delete_pair(kvs_table, keys[i]) != 0) {
-      if(!aux){
-        strcat(final, "[");
-        aux = 1;
+  snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.ckpt", path);
+
+  // state = last checkpoint + whatever the log has after it
+  if (access(checkpoint_path, F_OK) == 0 &&
+      snapshot_load(checkpoint_path, kvs_table) != 0) {
+    return 1;
+  }
+  if (wal_replay(path, kvs_table) != 0) {
+    fprintf(stderr, "Failed to replay log %s\n", path);
+    return 1;
+  }
+  if (wal_open(path, commit_delay_us) != 0) {
+    return 1;
+  }
+  snprintf(wal_path, sizeof(wal_path), "%s", path);
+  // a checkpoint in place, the replayed records aren't needed anymore
+  return write_checkpoint();
+}
+
+void kvs_backup_chain_init(BackupChain *chain) {
+  chain->base_version = 0;
+  chain->since_checkpoint = 0;
+  chain->registered = 0;
+  chain->next = NULL;
+}
+
+// Drops the deletions that no running chain needs. chains_lock is held.
+static void trim_chains() {
+  uint64_t oldest = table_version(kvs_table);
+  for (BackupChain *chain = chains; chain != NULL; chain = chain->next) {
+    if (chain->base_version < oldest) {
+      oldest = chain->base_version;
+    }
+  }
+  trim_deleted(kvs_table, oldest);
+}
+
+void kvs_backup_chain_end(BackupChain *chain) {
+  if (!chain->registered) {
+    return;
+  }
+  pthread_mutex_lock(&chains_lock);
+  BackupChain **link = &chains;
+  while (*link != chain) {
+    link = &(*link)->next;
+  }
+  *link = chain->next;
+  chain->registered = 0;
+  trim_chains();
+  pthread_mutex_unlock(&chains_lock);
+}
+
+// A backup being written by its own thread from a view of the table.
+typedef struct BackupJob {
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  char header[MAX_JOB_FILE_NAME_SIZE + 16]; // "#DELTA <base>" or empty
+  uint64_t since; // only pairs written after this version go in
+  DeletedKey *deleted;
+  size_t num_deleted;
+  size_t count; // pairs in the view
+  TableView view;
+} BackupJob;
+
+struct pair_list {
+  KeyNode *pairs;
+  size_t count;
+  size_t capacity;
+};
+
+static void collect_pair(const KeyNode *keyNode, void *arg) {
+  struct pair_list *list = arg;
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+    KeyNode *pairs = realloc(list->pairs, capacity * sizeof(KeyNode));
+    if (!pairs)
+      return;
+    list->pairs = pairs;
+    list->capacity = capacity;
+  }
+  memcpy(list->pairs[list->count].key, keyNode->key, MAX_STRING_SIZE);
+  memcpy(list->pairs[list->count].value, keyNode->value, MAX_STRING_SIZE);
+  list->pairs[list->count++].version = keyNode->version;
+}
+
+static int compare_nodes(const void *a, const void *b) {
+  return strcmp(((const KeyNode *)a)->key, ((const KeyNode *)b)->key);
+}
+
+// Writes every pair of a view in bucket order, as SHOW does, or sorted by key
+// when sorted_output is on.
+// @return 0 on success, 1 if part of the view was lost.
+static int write_view(BackupJob *job, struct dump *dump) {
+  int failed = view_capture(kvs_table, &job->view);
+  if (!sorted_output || binary_backups) {
+    dump->view = &job->view;
+    run_dump(dump, job->count);
+    return failed;
+  }
+
+  struct pair_list list = {NULL, 0, 0};
+  view_visit_buckets(&job->view, 0, 1, collect_pair, &list);
+  if (list.count > 0) {
+    qsort(list.pairs, list.count, sizeof(KeyNode), compare_nodes);
+  }
+  dump->nodes = malloc(list.count * sizeof(KeyNode *) + 1);
+  if (dump->nodes != NULL) {
+    for (size_t i = 0; i < list.count; i++) {
+      dump->nodes[i] = &list.pairs[i];
+    }
+    dump->num_nodes = list.count;
+    run_dump(dump, list.count);
+    free(dump->nodes);
+  } else {
+    for (size_t i = 0; i < list.count; i++) {
+      emit_pair(&list.pairs[i], dump);
+    }
+  }
+  free(list.pairs);
+  return failed;
+}
+
+static void *write_backup(void *arg) {
+  BackupJob *job = arg;
+  int backup_fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (backup_fd == -1) {
+    fprintf(stderr, "Failed to create backup %s: %s\n", job->path,
+            strerror(errno));
+  } else {
+    OutputBuffer out;
+    output_init(&out, backup_fd);
+    int failed;
+    struct dump dump = {.since = job->since, .out = &out};
+    if (binary_backups) {
+      SnapshotWriter writer;
+      dump.writer = &writer;
+      snapshot_begin(&writer, &out, job->count);
+      failed = write_view(job, &dump);
+      snapshot_end(&writer);
+    } else {
+      // "#DELTA <previous backup>", the deleted keys, then the written ones
+      output_puts(&out, job->header);
+      for (size_t i = 0; i < job->num_deleted; i++) {
+        output_write(&out, "-", 1);
+        output_puts(&out, job->deleted[i].key);
+        output_write(&out, "\n", 1);
       }
-      strcat(final, "(");
-      strcat(final, keys[i]);
-      strcat(final,",KVSMISSING)");
-      pthread_mutex_unlock(&kvs_table->locker_hashtable);
+      failed = write_view(job, &dump);
     }
-    pthread_mutex_unlock(&kvs_table->locker_hashtable);
+    if (output_close(&out) || failed) {
+      fprintf(stderr, "Failed to write backup %s\n", job->path);
+    }
+    close(backup_fd);
   }
-  if(aux){
-    strcat (final, "]\n");
+
+  view_close(kvs_table, &job->view);
+  free(job->deleted);
+  free(job);
+  release_backup();
+  return NULL;
+}
+
+int kvs_backup(char input_path[], int backup_count, BackupChain *chain) {
+  BackupJob *job = malloc(sizeof(BackupJob));
+  if (!job) {
+    return 1;
+  }
+  snprintf(job->path, sizeof(job->path), "%.*s-%d%s",
+           (int)strlen(input_path) - 4, input_path, backup_count,
+           binary_backups ? SNAPSHOT_EXTENSION : ".bck");
+
+  // With incremental backups only the first and every checkpoint_interval-th
+  // backup of a job are full; the others only have what changed since the
+  // job's previous backup.
+  int delta = checkpoint_interval > 1 && chain->registered &&
+              chain->since_checkpoint + 1 < checkpoint_interval;
+  job->header[0] = '\0';
+  if (delta && !binary_backups) {
+    const char *base_name = strrchr(job->path, '/');
+    base_name = base_name ? base_name + 1 : job->path;
+    snprintf(job->header, sizeof(job->header), "%s%.*s%d.bck\n",
+             BACKUP_DELTA_HEADER,
+             (int)(strrchr(base_name, '-') - base_name + 1), base_name,
+             backup_count - 1);
   }
-  write(output_fd, final, strlen(final));
+  job->since = delta ? chain->base_version : 0;
+  job->deleted = NULL;
+  job->num_deleted = 0;
 
+  // waits for a free slot before locking the table
+  reserve_backup();
+
+  // The table is only locked to open the view; the backup is written by
+  // another thread while jobs keep writing, without a fork.
+  lock_table(kvs_table, 0);
+  if (delta) {
+    job->num_deleted = deleted_since(kvs_table, chain->base_version, &job->deleted);
+  }
+  uint64_t version = table_version(kvs_table);
+  job->count = atomic_load(&kvs_table->count);
+  view_open(kvs_table, &job->view);
+  unlock_table(kvs_table);
+
+  pthread_t writer;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&writer, &attr, write_backup, job) != 0) {
+    write_backup(job); // no thread to spare, write it here
+  }
+  pthread_attr_destroy(&attr);
+
+  if (checkpoint_interval > 1) {
+    pthread_mutex_lock(&chains_lock);
+    chain->base_version = version;
+    chain->since_checkpoint = delta ? chain->since_checkpoint + 1 : 0;
+    if (!chain->registered) {
+      chain->next = chains;
+      chains = chain;
+      chain->registered = 1;
+    }
+    trim_chains();
+    pthread_mutex_unlock(&chains_lock);
+  }
   return 0;
 }
 
-void kvs_show(int output_fd) {
-  char final[MAX_WRITE_SIZE];
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    pthread_mutex_lock(&kvs_table->locker_hashtable);
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL) {
-      sprintf(final, "(%s, %s)\n", keyNode->key, keyNode->value);
-      keyNode = keyNode->next; // Move to the next node
-      write(output_fd, final, strlen(final));
+// Applies one backup file to the table: "(key, value)" lines are written and
+// "-key" lines deleted. The delta header, if any, is skipped.
+static int apply_backup(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open backup %s\n", path);
+    return 1;
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, file)) > 0) {
+    if (line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (line[0] == '-') {
+      lock_key(kvs_table, line + 1, 1);
+      delete_pair(kvs_table, line + 1);
+      unlock_key(kvs_table, line + 1);
+    } else if (line[0] == '(' && len >= 2 && line[len - 1] == ')') {
+      // keys can't contain ',', so the first ", " ends the key
+      char *separator = strstr(line, ", ");
+      if (separator == NULL) {
+        continue;
+      }
+      *separator = '\0';
+      line[len - 1] = '\0';
+      lock_key(kvs_table, line + 1, 1);
+      write_pair(kvs_table, line + 1, separator + 2);
+      unlock_key(kvs_table, line + 1);
     }
-    pthread_mutex_unlock(&kvs_table->locker_hashtable);
   }
-  
+
+  free(line);
+  fclose(file);
+  return 0;
 }
 
-void kvs_backup(char input_path[], int backup_count) { 
-  //alteracao
-  int lenght = snprintf(NULL, 0, "%d", backup_count);
-  char *str = malloc((size_t)lenght + 1); 
-  char backup_path[MAX_JOB_FILE_NAME_SIZE] = "";
-  strncpy(backup_path, input_path, strlen(input_path) - 4);
-  strcat(backup_path, "-");
-  sprintf(str, "%d", backup_count);
-  strcat(backup_path, str);
-  strcat(backup_path, ".bck");
-  int backup_fd = open(backup_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-  free(str);
-  kvs_show(backup_fd);
-  close(backup_fd);
+// Reads the base named by a delta backup's header into base, which has room
+// for MAX_JOB_FILE_NAME_SIZE bytes.
+// @return 1 if path is a delta, 0 if it is a full backup, -1 on error.
+static int backup_base(const char *path, char *base) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open backup %s\n", path);
+    return -1;
+  }
 
+  char header[MAX_JOB_FILE_NAME_SIZE + 16];
+  size_t prefix = strlen(BACKUP_DELTA_HEADER);
+  int is_delta = fgets(header, sizeof(header), file) != NULL &&
+                 strncmp(header, BACKUP_DELTA_HEADER, prefix) == 0;
+  fclose(file);
+  if (!is_delta) {
+    return 0;
+  }
+
+  header[strcspn(header, "\n")] = '\0';
+  // the base lives next to the delta
+  const char *slash = strrchr(path, '/');
+  int dir_len = slash ? (int)(slash - path + 1) : 0;
+  snprintf(base, MAX_JOB_FILE_NAME_SIZE, "%.*s%s", dir_len, path,
+           header + prefix);
+  return 1;
+}
+
+int kvs_load(const char *backup_path) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  if (is_snapshot(backup_path)) {
+    return snapshot_load(backup_path, kvs_table);
+  }
+
+  // walk back to the full checkpoint, then replay forward
+  size_t count = 0, capacity = 16;
+  char (*paths)[MAX_JOB_FILE_NAME_SIZE] =
+      malloc(capacity * MAX_JOB_FILE_NAME_SIZE);
+  if (!paths) {
+    return 1;
+  }
+  snprintf(paths[0], MAX_JOB_FILE_NAME_SIZE, "%s", backup_path);
+  count = 1;
+
+  int result;
+  while ((result = backup_base(paths[count - 1], paths[count])) == 1) {
+    if (++count == capacity) {
+      capacity *= 2;
+      char (*grown)[MAX_JOB_FILE_NAME_SIZE] =
+          realloc(paths, capacity * MAX_JOB_FILE_NAME_SIZE);
+      if (!grown) {
+        result = -1;
+        break;
+      }
+      paths = grown;
+    }
+  }
+
+  for (size_t i = count; result == 0 && i > 0; i--) {
+    result = apply_backup(paths[i - 1]);
+  }
+  free(paths);
+  return result != 0;
+}
+
+int kvs_rebuild_backup(const char *backup_path, OutputBuffer *out) {
+  if (kvs_load(backup_path) != 0) {
+    return 1;
+  }
+
+  kvs_show(out);
+  return 0;
 }
 
 void kvs_wait(unsigned int delay_ms) {
@@ -2,11 +2,71 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "output.h"
+
+// First line of a delta backup, followed by the name of the backup it
+// applies to.
+#define BACKUP_DELTA_HEADER "#DELTA "
+
+/// Backup history of one job, so its backups can be written as deltas of
+/// the previous one.
+typedef struct BackupChain {
+  uint64_t base_version;  // table version at the job's previous backup
+  unsigned int since_checkpoint; // deltas since the last full backup
+  int registered;
+  struct BackupChain *next;
+} BackupChain;
 
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
 
+/// Makes backups incremental. The first backup of a job, and then every
+/// interval-th one, is a full dump; the others only hold the keys written
+/// or deleted since the job's previous backup.
+/// @param interval Backups per full checkpoint. 0 or 1 keeps every backup
+/// full.
+/// @return 0 on success, 1 if the KVS is not initialized.
+int kvs_enable_deltas(unsigned int interval);
+
+/// Limits how many backups are written at once, across every job.
+/// @param max_backups Maximum number of concurrent backups, 0 counts as 1.
+void kvs_enable_backups(unsigned int max_backups);
+
+/// Makes backups binary snapshots, written to <job>-<n>.snap, instead of
+/// text.
+void kvs_enable_snapshots();
+
+/// Makes SHOW and text backups list the pairs in key order.
+void kvs_enable_sorted_output();
+
+// Most threads a SHOW, backup or checkpoint is formatted by.
+#define DUMP_MAX_THREADS 64
+
+/// Formats large SHOWs, backups and checkpoints on several threads, each
+/// taking its own range of buckets. The output is the same as with one.
+/// @param threads Threads per dump, up to DUMP_MAX_THREADS.
+void kvs_enable_parallel_dump(unsigned int threads);
+
+/// Loads a backup into the KVS, before any job runs. Snapshots are bulk
+/// loaded; text backups are replayed from their full checkpoint.
+/// @param backup_path Path of a snapshot, full or delta backup.
+/// @return 0 if the backup was loaded successfully, 1 otherwise.
+int kvs_load(const char *backup_path);
+
+/// Makes WRITE and DELETE durable through a write-ahead log. The state left
+/// by the last run (checkpoint plus log) is loaded first, then folded into a
+/// new checkpoint. Commands from all jobs are committed in groups, with one
+/// write and fdatasync per group. The log is folded into the checkpoint
+/// again every WAL_CHECKPOINT_BYTES logged.
+/// @param path Path of the log. The checkpoint is kept in <path>.ckpt.
+/// @param commit_delay_us How long each group waits for more commands.
+/// @return 0 on success, 1 otherwise.
+int kvs_enable_wal(const char *path, unsigned int commit_delay_us);
+
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
@@ -22,26 +82,148 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Buffer to write the (successful) output to.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int output_fd);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
+/// @param out Buffer to write the missing keys to, NULL to leave them out.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int output_fd);
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
+
+// What a job holding its writes back knows of a key.
+#define HELD_NONE 0    // nothing, the table has the key's state
+#define HELD_VALUE 1   // the job wrote it last
+#define HELD_DELETED 2 // the job deleted it last
+
+/// Like kvs_read, for a job holding some of its writes back.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @param values values[i] is the value of keys[i] if held[i] is HELD_VALUE.
+/// @param held What the job holds of each key. Only keys it holds nothing of
+/// are read from the table.
+/// @param out Buffer to write the (successful) output to.
+/// @return 0 if the key reading, 1 otherwise.
+int kvs_read_held(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                  char values[][MAX_STRING_SIZE], const unsigned char *held,
+                  OutputBuffer *out);
+
+/// Writes what kvs_delete would reply, for a job holding some of its writes
+/// back, without deleting anything.
+/// @param num_pairs Number of keys being deleted.
+/// @param keys Array of keys' strings.
+/// @param held What the job held of each key before the deletion. Only keys
+/// it holds nothing of are looked up in the table.
+/// @param out Buffer to write the missing keys to.
+/// @return 0 if the reply was written, 1 otherwise.
+int kvs_delete_reply(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                     const unsigned char *held, OutputBuffer *out);
+
+// Keys a write batch holds before it has to be applied.
+#define WRITE_BATCH_SIZE MAX_WRITE_SIZE
+
+/// WRITEs and DELETEs of one job that nothing has observed yet. Only the
+/// last effect on each key reaches the table, all at once, when the job
+/// reads one of the keys or runs a command that sees the whole table.
+typedef struct WriteBatch {
+  size_t count;
+  uint64_t next_order;
+  struct BatchEntry {
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    uint64_t order;         // write that may have inserted the key last
+    unsigned char deleted;  // the last effect was a DELETE
+    unsigned char reinsert; // deleted and written again, so not an overwrite
+  } entries[WRITE_BATCH_SIZE];
+  uint16_t index[2 * WRITE_BATCH_SIZE]; // entry + 1 by key hash, 0 if free
+} WriteBatch;
+
+/// Prepares an empty write batch.
+/// @param batch Batch to initialize.
+void kvs_batch_init(WriteBatch *batch);
+
+/// Like kvs_write, but the pairs are only added to the batch.
+/// @param batch Batch of the job.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @return 0 if the pairs were added successfully, 1 otherwise.
+int kvs_batch_write(WriteBatch *batch, size_t num_pairs,
+                    char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE]);
+
+/// Like kvs_read, applying the batch first if it holds any of the keys.
+/// @param batch Batch of the job.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @param out Buffer to write the (successful) output to.
+/// @return 0 if the key reading, 1 otherwise.
+int kvs_batch_read(WriteBatch *batch, size_t num_pairs,
+                   char keys[][MAX_STRING_SIZE], OutputBuffer *out);
+
+/// Like kvs_delete. When the batch holds every key the deletion is added to
+/// it; otherwise, or when backups are incremental and need the deletions in
+/// order, the batch is applied and the keys deleted from the table.
+/// @param batch Batch of the job.
+/// @param num_pairs Number of pairs to read.
+/// @param keys Array of keys' strings.
+/// @param out Buffer to write the missing keys to, NULL to leave them out.
+/// @return 0 if the pairs were deleted successfully, 1 otherwise.
+int kvs_batch_delete(WriteBatch *batch, size_t num_pairs,
+                     char keys[][MAX_STRING_SIZE], OutputBuffer *out);
+
+/// Applies the batch to the table and empties it. Keys are written in the
+/// order they were first written, so new keys end up where they would have
+/// one command at a time, unless the table resizes meanwhile: buckets then
+/// move at other points, and only key order (-s) stays the same.
+/// @param batch Batch of the job.
+/// @return 0 if every pair was applied successfully, 1 otherwise.
+int kvs_batch_flush(WriteBatch *batch);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int output_fd);
+/// @param out Buffer to write the output to.
+void kvs_show(OutputBuffer *out);
+
+/// Writes the pairs with keys between from and to, both included, in key
+/// order.
+/// @param from Smallest key written.
+/// @param to Largest key written.
+/// @param out Buffer to write the output to.
+void kvs_scan(const char *from, const char *to, OutputBuffer *out);
+
+/// Writes the latency, lock and chain length statistics gathered so far.
+/// Without STATS=1 only says they are disabled.
+/// @param out Buffer to write the output to.
+void kvs_stats(OutputBuffer *out);
+
+/// Prepares the backup chain of a job that is starting.
+/// @param chain Chain to initialize.
+void kvs_backup_chain_init(BackupChain *chain);
+
+/// Releases the backup chain of a job that ended.
+/// @param chain Chain given to kvs_backup.
+void kvs_backup_chain_end(BackupChain *chain);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(char input_path[], int backup_count);
+/// backup file. The file is written by a background thread from a view of
+/// the table at the time of the call, while jobs keep running. Waits only
+/// while max_backups backups are already being written.
+/// @param input_path Path of the job file requesting the backup.
+/// @param backup_count Number of the backup within the job.
+/// @param chain Backup chain of the job.
+/// @return 0 if the backup was started successfully, 1 otherwise.
+int kvs_backup(char input_path[], int backup_count, BackupChain *chain);
+
+/// Rebuilds the full content of a backup from its checkpoint and deltas,
+/// loading it into the KVS.
+/// @param backup_path Path of a snapshot, full or delta backup file.
+/// @param out Buffer to write the rebuilt backup to.
+/// @return 0 if the backup was rebuilt successfully, 1 otherwise.
+int kvs_rebuild_backup(const char *backup_path, OutputBuffer *out);
 
-/// Waits for the last backup to be called.
+/// Waits until every backup started so far has finished.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
@@ -0,0 +1,99 @@
+#include "output.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void output_init(OutputBuffer *out, int fd) {
+  out->fd = fd;
+  out->chunks = 0;
+  out->allocated = 0;
+  out->written = 0;
+}
+
+// Makes a new chunk the last one, allocating it the first time it is used.
+// @return 0 on success, 1 if there was no memory for it.
+static int next_chunk(OutputBuffer *out) {
+  if (out->chunks == out->allocated) {
+    char *chunk = malloc(OUTPUT_CHUNK_SIZE);
+    if (!chunk)
+      return 1;
+    out->iov[out->allocated++].iov_base = chunk;
+  }
+  out->iov[out->chunks++].iov_len = 0;
+  return 0;
+}
+
+int output_write(OutputBuffer *out, const char *buf, size_t len) {
+  out->written += len;
+  while (len > 0) {
+    if (out->chunks == 0 ||
+        out->iov[out->chunks - 1].iov_len == OUTPUT_CHUNK_SIZE) {
+      if (out->chunks == OUTPUT_MAX_CHUNKS && output_flush(out) != 0) {
+        return 1;
+      }
+      if (next_chunk(out) != 0) {
+        // no memory to keep buffering, write straight through
+        if (output_flush(out) != 0)
+          return 1;
+        return write(out->fd, buf, len) != (ssize_t)len;
+      }
+    }
+
+    struct iovec *last = &out->iov[out->chunks - 1];
+    size_t space = OUTPUT_CHUNK_SIZE - last->iov_len;
+    size_t n = len < space ? len : space;
+    memcpy((char *)last->iov_base + last->iov_len, buf, n);
+    last->iov_len += n;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int output_puts(OutputBuffer *out, const char *str) {
+  return output_write(out, str, strlen(str));
+}
+
+int output_flush(OutputBuffer *out) {
+  int result = 0;
+  // writev may stop early; resume from where it did with a copy of the
+  // vector so the chunk pointers stay intact for reuse
+  struct iovec pending[OUTPUT_MAX_CHUNKS];
+  memcpy(pending, out->iov, sizeof(struct iovec) * (size_t)out->chunks);
+  struct iovec *iov = pending;
+  int count = out->chunks;
+
+  while (count > 0) {
+    ssize_t written = writev(out->fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      result = 1;
+      break;
+    }
+    size_t done = (size_t)written;
+    while (count > 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+
+  out->chunks = 0;
+  return result;
+}
+
+int output_close(OutputBuffer *out) {
+  int result = output_flush(out);
+  for (int i = 0; i < out->allocated; i++) {
+    free(out->iov[i].iov_base);
+  }
+  out->allocated = 0;
+  return result;
+}
@@ -0,0 +1,50 @@
+#ifndef KVS_OUTPUT_H
+#define KVS_OUTPUT_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Size of each chunk of pending output.
+#define OUTPUT_CHUNK_SIZE 16384
+// Chunks filled before they are written out together with one writev.
+#define OUTPUT_MAX_CHUNKS 16
+
+/// Output of a job or backup, gathered in memory and written in large
+/// batches instead of one write per command.
+typedef struct OutputBuffer {
+  int fd;
+  int chunks;       // chunks holding pending output
+  int allocated;    // chunks allocated so far, reused across flushes
+  size_t written;   // bytes appended since output_init
+  struct iovec iov[OUTPUT_MAX_CHUNKS];
+} OutputBuffer;
+
+/// Prepares a buffer for writing to a file descriptor.
+/// @param out Buffer to initialize.
+/// @param fd File descriptor the output goes to.
+void output_init(OutputBuffer *out, int fd);
+
+/// Appends bytes to the buffer, flushing it when every chunk is full.
+/// @param out Buffer to append to.
+/// @param buf Bytes to append.
+/// @param len Number of bytes to append.
+/// @return 0 on success, 1 if a write failed.
+int output_write(OutputBuffer *out, const char *buf, size_t len);
+
+/// Appends a NUL terminated string to the buffer.
+/// @param out Buffer to append to.
+/// @param str String to append.
+/// @return 0 on success, 1 if a write failed.
+int output_puts(OutputBuffer *out, const char *str);
+
+/// Writes all pending output to the file descriptor.
+/// @param out Buffer to flush.
+/// @return 0 on success, 1 if a write failed.
+int output_flush(OutputBuffer *out);
+
+/// Flushes the buffer and frees its chunks. The file descriptor is left open.
+/// @param out Buffer to close.
+/// @return 0 on success, 1 if a write failed.
+int output_close(OutputBuffer *out);
+
+#endif // KVS_OUTPUT_H
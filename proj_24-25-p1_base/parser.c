@@ -1,5 +1,6 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,67 @@
 
 #include "constants.h"
 
+// Job files are consumed a few bytes at a time, so reads go through a per
+// thread chunk buffer instead of hitting the kernel for every character. A
+// worker only parses one job at a time, which makes one slot per thread enough;
+// the slot is rebound whenever a different descriptor is read from, and
+// emptied by forget_input before its descriptor is closed or rewound.
+struct read_buffer {
+  int fd;
+  size_t pos;
+  size_t len;
+  char data[READ_BUFFER_SIZE];
+};
+
+static _Thread_local struct read_buffer reader = {.fd = -1};
+
+// Drop-in replacement for read(2) that serves bytes from the chunk buffer.
+// Like read() on a regular file, it only returns less than count at the end
+// of the file, and -1 if an error happened before anything was read.
+static ssize_t buffered_read(int fd, char *buf, size_t count) {
+  if (reader.fd != fd) {
+    reader.fd = fd;
+    reader.pos = 0;
+    reader.len = 0;
+  }
+
+  size_t done = 0;
+  while (done < count) {
+    if (reader.pos == reader.len) {
+      ssize_t bytes_read = read(fd, reader.data, READ_BUFFER_SIZE);
+      if (bytes_read < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return done > 0 ? (ssize_t)done : -1;
+      }
+      if (bytes_read == 0) {
+        break;
+      }
+      reader.pos = 0;
+      reader.len = (size_t)bytes_read;
+    }
+
+    size_t chunk = reader.len - reader.pos;
+    if (chunk > count - done) {
+      chunk = count - done;
+    }
+    memcpy(buf + done, reader.data + reader.pos, chunk);
+    reader.pos += chunk;
+    done += chunk;
+  }
+
+  return (ssize_t)done;
+}
+
+void forget_input(int fd) {
+  if (reader.fd == fd) {
+    reader.fd = -1;
+    reader.pos = 0;
+    reader.len = 0;
+  }
+}
+
 static int read_string(int fd, char *buffer, size_t max) {
   ssize_t bytes_read;
   char ch;
@@ -14,7 +76,7 @@ static int read_string(int fd, char *buffer, size_t max) {
   int value = -1;
 
   while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+    bytes_read = buffered_read(fd, &ch, 1);
 
     if (bytes_read <= 0) {
       return -1;
@@ -48,7 +110,7 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (buffered_read(fd, buf + i, 1) == 0) {
       *next = '\0';
       break;
     }
@@ -76,20 +138,20 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
 static void cleanup(int fd) {
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (buffered_read(fd, &ch, 1) == 1 && ch != '\n')
     ;
 }
 
 enum Command get_next(int fd) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (buffered_read(fd, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
   case 'W':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-      if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+    if (buffered_read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+      if (buffered_read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -99,7 +161,7 @@ enum Command get_next(int fd) {
     return CMD_WAIT;
 
   case 'R':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+    if (buffered_read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -107,7 +169,7 @@ enum Command get_next(int fd) {
     return CMD_READ;
 
   case 'D':
-    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+    if (buffered_read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -115,12 +177,40 @@ enum Command get_next(int fd) {
     return CMD_DELETE;
 
   case 'S':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+    if (buffered_read(fd, buf + 1, 3) != 3 ||
+        (strncmp(buf, "SHOW", 4) != 0 && strncmp(buf, "SCAN", 4) != 0 &&
+         strncmp(buf, "STAT", 4) != 0)) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+    if (buf[1] == 'C') {
+      ssize_t bytes_read = buffered_read(fd, buf + 4, 1);
+      if (bytes_read == 1 && buf[4] == ' ') {
+        return CMD_SCAN;
+      }
+      if (bytes_read == 1 && buf[4] != '\n') {
+        cleanup(fd);
+      }
+      return CMD_INVALID;
+    }
+
+    if (buf[1] == 'T') {
+      ssize_t bytes_read = buffered_read(fd, buf + 4, 1);
+      if (bytes_read != 1 || buf[4] != 'S') {
+        if (bytes_read == 1 && buf[4] != '\n') {
+          cleanup(fd);
+        }
+        return CMD_INVALID;
+      }
+      if (buffered_read(fd, buf + 5, 1) != 0 && buf[5] != '\n') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      return CMD_STATS;
+    }
+
+    if (buffered_read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -128,12 +218,12 @@ enum Command get_next(int fd) {
     return CMD_SHOW;
 
   case 'B':
-    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+    if (buffered_read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
+    if (buffered_read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -141,12 +231,12 @@ enum Command get_next(int fd) {
     return CMD_BACKUP;
 
   case 'H':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+    if (buffered_read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
       cleanup(fd);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+    if (buffered_read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
       cleanup(fd);
       return CMD_INVALID;
     }
@@ -185,12 +275,12 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
                    size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  if (buffered_read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
+  if (buffered_read(fd, &ch, 1) != 1 || ch != '(') {
     cleanup(fd);
     return 0;
   }
@@ -207,7 +297,7 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
     strcpy(keys[num_pairs], key);
     strcpy(values[num_pairs++], value);
 
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+    if (buffered_read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
       return 0;
     }
@@ -222,7 +312,7 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (buffered_read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -234,7 +324,7 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
                          size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  if (buffered_read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
@@ -260,7 +350,7 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (buffered_read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -9,6 +9,8 @@ enum Command {
   CMD_READ,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_SCAN,
+  CMD_STATS,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -22,6 +24,12 @@ enum Command {
 /// @return The command read.
 enum Command get_next(int fd);
 
+/// Drops what the calling thread read ahead from a file descriptor, so a
+/// job that stopped early leaves nothing behind for the next file given the
+/// same number. Call before closing or seeking fd.
+/// @param fd File descriptor that was read from.
+void forget_input(int fd);
+
 /// Parses a WRITE command.
 /// @param fd File descriptor to read from.
 /// @param keys Array of keys to be written.
@@ -33,7 +41,7 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
                    char values[][MAX_STRING_SIZE], size_t max_pairs,
                    size_t max_string_size);
 
-/// Parses a READ or DELETE command.
+/// Parses a READ, DELETE or SCAN command.
 /// @param fd File descriptor to read from.
 /// @param keys Array of keys to be written.
 /// @param max_keys number of keys to be iread or deleted.
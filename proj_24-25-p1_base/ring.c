@@ -0,0 +1,77 @@
+#include "ring.h"
+
+#include <stdlib.h>
+
+int ring_init(Ring *ring, size_t slot_size, size_t capacity) {
+  ring->slots = malloc(slot_size * capacity);
+  if (!ring->slots) {
+    return 1;
+  }
+  ring->slot_size = slot_size;
+  ring->capacity = capacity;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->sleeping, 0);
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+  return 0;
+}
+
+void ring_destroy(Ring *ring) {
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->cond);
+  free(ring->slots);
+}
+
+// Wakes the other thread if it is asleep. The index it waits on was already
+// moved, and sleeping is raised before it checks again, so either it sees the
+// new index or this sees it sleeping.
+static void wake(Ring *ring) {
+  if (atomic_load(&ring->sleeping) > 0) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+void *ring_reserve(Ring *ring) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail - atomic_load(&ring->head) == ring->capacity) {
+    // sleep until half the ring is free, not after every slot
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->sleeping, 1);
+    while (tail - atomic_load(&ring->head) > ring->capacity / 2) {
+      pthread_cond_wait(&ring->cond, &ring->lock);
+    }
+    atomic_fetch_sub(&ring->sleeping, 1);
+    pthread_mutex_unlock(&ring->lock);
+  }
+  return ring->slots + (tail % ring->capacity) * ring->slot_size;
+}
+
+void ring_publish(Ring *ring) {
+  atomic_fetch_add(&ring->tail, 1);
+  wake(ring);
+}
+
+void *ring_peek(Ring *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (atomic_load(&ring->tail) == head) {
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->sleeping, 1);
+    while (atomic_load(&ring->tail) == head) {
+      pthread_cond_wait(&ring->cond, &ring->lock);
+    }
+    atomic_fetch_sub(&ring->sleeping, 1);
+    pthread_mutex_unlock(&ring->lock);
+  }
+  return ring->slots + (head % ring->capacity) * ring->slot_size;
+}
+
+void ring_release(Ring *ring) {
+  size_t head = atomic_fetch_add(&ring->head, 1) + 1;
+  // the producer sleeps until half the ring is free
+  if (atomic_load(&ring->tail) - head <= ring->capacity / 2) {
+    wake(ring);
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef KVS_RING_H
+#define KVS_RING_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/// Bounded queue of fixed size slots between one producer and one consumer
+/// thread. Slots are filled and used in place, and the two threads only meet
+/// on the mutex when one of them has to sleep on a full or empty ring.
+typedef struct Ring {
+  char *slots;
+  size_t slot_size;
+  size_t capacity;
+  atomic_size_t head;  // slots released by the consumer
+  atomic_size_t tail;  // slots published by the producer
+  atomic_int sleeping; // threads waiting on cond
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} Ring;
+
+/// Prepares an empty ring.
+/// @param ring Ring to initialize.
+/// @param slot_size Size of each slot.
+/// @param capacity Number of slots, at least 2.
+/// @return 0 on success, 1 if there was no memory for the slots.
+int ring_init(Ring *ring, size_t slot_size, size_t capacity);
+
+/// Frees the slots of a ring neither thread uses anymore.
+/// @param ring Ring to free.
+void ring_destroy(Ring *ring);
+
+/// Returns the next slot for the producer to fill. Once the ring is full it
+/// waits until the consumer has emptied half of it.
+/// @param ring Ring to write to.
+/// @return Slot to fill, handed over with ring_publish.
+void *ring_reserve(Ring *ring);
+
+/// Hands the slot returned by ring_reserve over to the consumer.
+/// @param ring Ring given to ring_reserve.
+void ring_publish(Ring *ring);
+
+/// Returns the oldest published slot, waiting for one if the ring is empty.
+/// @param ring Ring to read from.
+/// @return Slot to use, given back with ring_release.
+void *ring_peek(Ring *ring);
+
+/// Gives the slot returned by ring_peek back to the producer.
+/// @param ring Ring given to ring_peek.
+void ring_release(Ring *ring);
+
+#endif // KVS_RING_H
@@ -0,0 +1,133 @@
+#include "skiplist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t node_size(size_t height) {
+  return sizeof(SkipNode) + height * sizeof(SkipNode *);
+}
+
+// Reuses a removed node of the same height, or carves one from the newest
+// block.
+static SkipNode *new_node(SkipList *list, size_t height) {
+  SkipNode *node = list->spare[height - 1];
+  if (node != NULL) {
+    list->spare[height - 1] = node->next[0];
+    return node;
+  }
+  size_t size = node_size(height);
+  if (list->blocks == NULL || list->block_used + size > SKIPLIST_BLOCK_SIZE) {
+    SkipBlock *block = malloc(sizeof(SkipBlock));
+    if (!block)
+      return NULL;
+    block->next = list->blocks;
+    list->blocks = block;
+    list->block_used = 0;
+  }
+  node = (SkipNode *)(list->blocks->data + list->block_used);
+  list->block_used += size;
+  return node;
+}
+
+// Each level holds about a quarter of the nodes of the one below.
+static size_t random_height(SkipList *list) {
+  list->rng ^= list->rng << 13;
+  list->rng ^= list->rng >> 7;
+  list->rng ^= list->rng << 17;
+  size_t height = 1;
+  for (uint64_t bits = list->rng;
+       height < SKIPLIST_MAX_HEIGHT && (bits & 3) == 0; bits >>= 2) {
+    height++;
+  }
+  return height;
+}
+
+// Fills update with the last node before key on each level.
+static void find_preceding(const SkipList *list, const char *key,
+                           SkipNode **update) {
+  SkipNode *node = list->head;
+  for (size_t level = list->height; level > 0; level--) {
+    while (node->next[level - 1] != NULL &&
+           strcmp(node->next[level - 1]->key, key) < 0) {
+      node = node->next[level - 1];
+    }
+    update[level - 1] = node;
+  }
+}
+
+int skiplist_init(SkipList *list) {
+  list->head = calloc(1, node_size(SKIPLIST_MAX_HEIGHT));
+  if (!list->head)
+    return 1;
+  for (size_t i = 0; i < SKIPLIST_MAX_HEIGHT; i++) {
+    list->spare[i] = NULL;
+  }
+  list->blocks = NULL;
+  list->block_used = 0;
+  list->height = 1;
+  list->rng = 0x2545f4914f6cdd1dULL;
+  return 0;
+}
+
+int skiplist_insert(SkipList *list, const char *key, uint64_t hash) {
+  SkipNode *update[SKIPLIST_MAX_HEIGHT];
+  size_t height = random_height(list);
+  SkipNode *node = new_node(list, height);
+  if (!node)
+    return 1;
+  strncpy(node->key, key, MAX_STRING_SIZE - 1);
+  node->key[MAX_STRING_SIZE - 1] = '\0';
+  node->hash = hash;
+
+  find_preceding(list, key, update);
+  for (size_t level = list->height; level < height; level++) {
+    update[level] = list->head;
+  }
+  if (height > list->height) {
+    list->height = height;
+  }
+  for (size_t level = 0; level < height; level++) {
+    node->next[level] = update[level]->next[level];
+    update[level]->next[level] = node;
+  }
+  return 0;
+}
+
+void skiplist_remove(SkipList *list, const char *key) {
+  SkipNode *update[SKIPLIST_MAX_HEIGHT];
+  find_preceding(list, key, update);
+  SkipNode *node = update[0]->next[0];
+  if (node == NULL || strcmp(node->key, key) != 0)
+    return;
+  size_t height = 0;
+  for (; height < list->height; height++) {
+    if (update[height]->next[height] != node) {
+      break; // the node is no taller than this
+    }
+    update[height]->next[height] = node->next[height];
+  }
+  while (list->height > 1 && list->head->next[list->height - 1] == NULL) {
+    list->height--;
+  }
+  node->next[0] = list->spare[height - 1];
+  list->spare[height - 1] = node;
+}
+
+const SkipNode *skiplist_seek(const SkipList *list, const char *from) {
+  if (from == NULL) {
+    return list->head->next[0];
+  }
+  SkipNode *update[SKIPLIST_MAX_HEIGHT];
+  find_preceding(list, from, update);
+  return update[0]->next[0];
+}
+
+void skiplist_destroy(SkipList *list) {
+  while (list->blocks != NULL) {
+    SkipBlock *next = list->blocks->next;
+    free(list->blocks);
+    list->blocks = next;
+  }
+  free(list->head);
+  list->head = NULL;
+}
@@ -0,0 +1,69 @@
+#ifndef KVS_SKIPLIST_H
+#define KVS_SKIPLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Levels of the skip list, enough for 4^16 keys.
+#define SKIPLIST_MAX_HEIGHT 16
+// Bytes of each block nodes are carved from
+#define SKIPLIST_BLOCK_SIZE 16384
+
+/// A key of the ordered index. Only the key and its hash are kept; the value
+/// is looked up in the hash table.
+typedef struct SkipNode {
+  char key[MAX_STRING_SIZE];
+  uint64_t hash;
+  struct SkipNode *next[]; // one link per level of the node
+} SkipNode;
+
+/// Memory nodes are carved from, so adding a key rarely allocates.
+typedef struct SkipBlock {
+  struct SkipBlock *next;
+  char data[SKIPLIST_BLOCK_SIZE];
+} SkipBlock;
+
+/// Keys in strcmp order. Not synchronized: the caller serializes changes and
+/// keeps them out while walking it.
+typedef struct SkipList {
+  SkipNode *head; // SKIPLIST_MAX_HEIGHT links, no key
+  size_t height;  // levels in use
+  uint64_t rng;   // picks node heights
+  // Removed nodes, by height - 1 and chained through next[0], reused before
+  // carving new ones.
+  SkipNode *spare[SKIPLIST_MAX_HEIGHT];
+  SkipBlock *blocks; // every block ever allocated, freed in bulk
+  size_t block_used; // bytes handed out from the newest block
+} SkipList;
+
+/// Prepares an empty skip list.
+/// @param list List to initialize.
+/// @return 0 on success, 1 if there was no memory.
+int skiplist_init(SkipList *list);
+
+/// Adds a key that is not in the list yet.
+/// @param list List to add to.
+/// @param key Key to add.
+/// @param hash Hash of the key in the table.
+/// @return 0 on success, 1 if there was no memory.
+int skiplist_insert(SkipList *list, const char *key, uint64_t hash);
+
+/// Removes a key, if present. Its node is kept for a later insert.
+/// @param list List to remove from.
+/// @param key Key to remove.
+void skiplist_remove(SkipList *list, const char *key);
+
+/// Finds the first key not smaller than a given one, in O(log n). Following
+/// next[0] from there visits the rest in order.
+/// @param list List to search.
+/// @param from Lower bound, NULL for the first key.
+/// @return The node found, NULL if every key is smaller.
+const SkipNode *skiplist_seek(const SkipList *list, const char *from);
+
+/// Frees every node of the list.
+/// @param list List to free.
+void skiplist_destroy(SkipList *list);
+
+#endif // KVS_SKIPLIST_H
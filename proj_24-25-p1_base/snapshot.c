@@ -0,0 +1,193 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int bit = 0; bit < 8; bit++) {
+      c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *bytes = buf;
+  pthread_once(&crc_once, init_crc_table);
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+int sync_parent(const char *path) {
+  char dir[MAX_JOB_FILE_NAME_SIZE + 16];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char *slash = strrchr(dir, '/');
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else if (slash == dir) {
+    slash[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
+    return 1;
+  int result = fsync(fd) != 0;
+  close(fd);
+  return result;
+}
+
+static void put(SnapshotWriter *writer, const void *buf, size_t len) {
+  writer->crc = crc32_update(writer->crc, buf, len);
+  output_write(writer->out, buf, len);
+}
+
+void snapshot_begin(SnapshotWriter *writer, OutputBuffer *out, uint64_t count) {
+  unsigned char size[8];
+  for (int i = 0; i < 8; i++) {
+    size[i] = (unsigned char)(count >> (8 * i));
+  }
+  writer->out = out;
+  writer->crc = 0;
+  put(writer, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+  put(writer, size, sizeof(size));
+}
+
+size_t snapshot_record(char *buf, const char *key, const char *value) {
+  size_t pos = 0;
+  const char *strings[2] = {key, value};
+  for (int i = 0; i < 2; i++) {
+    size_t len = strlen(strings[i]);
+    buf[pos++] = (char)len;
+    memcpy(buf + pos, strings[i], len);
+    pos += len;
+  }
+  return pos;
+}
+
+void snapshot_add(SnapshotWriter *writer, const char *key, const char *value) {
+  char record[SNAPSHOT_RECORD_SIZE];
+  put(writer, record, snapshot_record(record, key, value));
+}
+
+void snapshot_write(SnapshotWriter *writer, const void *records, size_t len) {
+  put(writer, records, len);
+}
+
+void snapshot_end(SnapshotWriter *writer) {
+  unsigned char crc[4];
+  for (int i = 0; i < 4; i++) {
+    crc[i] = (unsigned char)(writer->crc >> (8 * i));
+  }
+  output_write(writer->out, (const char *)crc, sizeof(crc));
+}
+
+int is_snapshot(const char *path) {
+  char magic[SNAPSHOT_MAGIC_SIZE];
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  int result = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+               memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) == 0;
+  close(fd);
+  return result;
+}
+
+static uint64_t get_le(const unsigned char *buf, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+// Reads one length prefixed string into dest, which holds MAX_STRING_SIZE.
+// @return Bytes consumed, 0 if the string doesn't fit in the record area.
+static size_t get_string(const unsigned char *buf, size_t avail, char *dest) {
+  if (avail < 1 || buf[0] >= MAX_STRING_SIZE || avail < 1 + (size_t)buf[0]) {
+    return 0;
+  }
+  memcpy(dest, buf + 1, buf[0]);
+  dest[buf[0]] = '\0';
+  return 1 + (size_t)buf[0];
+}
+
+// Checks and inserts the pairs of a mapped snapshot.
+static int load_mapped(const unsigned char *data, size_t size, HashTable *ht) {
+  size_t header = SNAPSHOT_MAGIC_SIZE + 8;
+  if (size < header + 4 ||
+      memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0) {
+    return 1;
+  }
+  size_t body = size - 4;
+  if (crc32_update(0, data, body) != (uint32_t)get_le(data + body, 4)) {
+    fprintf(stderr, "Snapshot checksum mismatch\n");
+    return 1;
+  }
+
+  uint64_t count = get_le(data + SNAPSHOT_MAGIC_SIZE, 8);
+  if (reserve_table(ht, (size_t)count) != 0) {
+    return 1;
+  }
+
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  size_t pos = header;
+  for (uint64_t i = 0; i < count; i++) {
+    size_t used = get_string(data + pos, body - pos, key);
+    if (used == 0)
+      return 1;
+    pos += used;
+    used = get_string(data + pos, body - pos, value);
+    if (used == 0)
+      return 1;
+    pos += used;
+    if (write_pair(ht, key, value) != 0)
+      return 1;
+  }
+  return pos != body;
+}
+
+int snapshot_load(const char *path, HashTable *ht) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open snapshot %s\n", path);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+
+  int result = load_mapped(data, size, ht);
+  munmap(data, size);
+  if (result != 0) {
+    fprintf(stderr, "Invalid snapshot %s\n", path);
+  }
+  return result;
+}
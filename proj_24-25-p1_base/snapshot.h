@@ -0,0 +1,81 @@
+#ifndef KVS_SNAPSHOT_H
+#define KVS_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kvs.h"
+#include "output.h"
+
+// Binary snapshot layout, integers little endian:
+//   "KVSSNAP1"                    magic
+//   u64 count                     number of pairs
+//   count x (u8 key length, key, u8 value length, value)
+//   u32 crc                       CRC-32 of every byte before it
+#define SNAPSHOT_MAGIC "KVSSNAP1"
+#define SNAPSHOT_MAGIC_SIZE 8
+#define SNAPSHOT_EXTENSION ".snap"
+// Largest record a pair can take.
+#define SNAPSHOT_RECORD_SIZE (2 * MAX_STRING_SIZE)
+
+/// Continues a CRC-32 (IEEE) over more bytes.
+/// @param crc CRC of the bytes before, 0 to start.
+/// @param buf Bytes to add.
+/// @param len Number of bytes.
+/// @return Updated CRC.
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+/// Flushes the directory of a file, so a rename into it survives a crash.
+/// @param path Path of the file.
+/// @return 0 on success, 1 otherwise.
+int sync_parent(const char *path);
+
+/// Snapshot being written to an output buffer.
+typedef struct SnapshotWriter {
+  OutputBuffer *out;
+  uint32_t crc;
+} SnapshotWriter;
+
+/// Writes the snapshot header.
+/// @param writer Writer to initialize.
+/// @param out Buffer the snapshot is written to.
+/// @param count Number of pairs that will be added.
+void snapshot_begin(SnapshotWriter *writer, OutputBuffer *out, uint64_t count);
+
+/// Appends a pair to the snapshot.
+/// @param writer Writer given to snapshot_begin.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+void snapshot_add(SnapshotWriter *writer, const char *key, const char *value);
+
+/// Formats a pair as it is stored in a snapshot, so it can be prepared away
+/// from the writer and added later with snapshot_write.
+/// @param buf Buffer with room for SNAPSHOT_RECORD_SIZE bytes.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @return Size of the record.
+size_t snapshot_record(char *buf, const char *key, const char *value);
+
+/// Appends records made by snapshot_record to the snapshot.
+/// @param writer Writer given to snapshot_begin.
+/// @param records Records, one after the other.
+/// @param len Total size of the records.
+void snapshot_write(SnapshotWriter *writer, const void *records, size_t len);
+
+/// Writes the checksum that closes the snapshot.
+/// @param writer Writer given to snapshot_begin.
+void snapshot_end(SnapshotWriter *writer);
+
+/// Checks whether a file starts like a snapshot.
+/// @param path Path of the file.
+/// @return 1 if it is a snapshot, 0 otherwise.
+int is_snapshot(const char *path);
+
+/// Loads a snapshot into a table nobody else is using yet. The buckets are
+/// sized for the whole snapshot up front and no locks are taken.
+/// @param path Path of the snapshot.
+/// @param ht Table to load into.
+/// @return 0 if the snapshot was loaded, 1 if it is unreadable or corrupt.
+int snapshot_load(const char *path, HashTable *ht);
+
+#endif // KVS_SNAPSHOT_H
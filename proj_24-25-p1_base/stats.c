@@ -0,0 +1,215 @@
+#include "stats.h"
+
+#ifdef KVS_STATS
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Latencies below HIST_LINEAR ns get a bucket each; above that every power of
+// two is split in HIST_SUB buckets, so a bucket is within 12.5% of its values.
+#define HIST_LINEAR 16
+#define HIST_SUB 8
+#define HIST_BUCKETS (HIST_LINEAR + (64 - 4) * HIST_SUB)
+#define NUM_COMMANDS (EOC + 1)
+// Holds of the same lock type a thread can have open at once and still time.
+#define HOLD_DEPTH 8
+
+// Counters of one thread. Only the owner writes them, with plain loads and
+// stores; atomics just let stats_print read them meanwhile.
+typedef struct ThreadStats {
+  atomic_uint_fast64_t latency[NUM_COMMANDS][HIST_BUCKETS];
+  atomic_uint_fast64_t latency_sum[NUM_COMMANDS];
+  atomic_uint_fast64_t acquired[STAT_LOCKS];
+  atomic_uint_fast64_t contended[STAT_LOCKS];
+  atomic_uint_fast64_t wait_ns[STAT_LOCKS];
+  atomic_uint_fast64_t hold_ns[STAT_LOCKS];
+  // starts of the holds still open, innermost last; hold_depth may pass
+  // HOLD_DEPTH, and those deeper holds aren't timed
+  uint64_t hold_start[STAT_LOCKS][HOLD_DEPTH];
+  size_t hold_depth[STAT_LOCKS];
+  struct ThreadStats *next;
+} ThreadStats;
+
+static _Thread_local ThreadStats *local = NULL;
+static ThreadStats *all_stats = NULL;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *command_names[NUM_COMMANDS] = {
+    [CMD_WRITE] = "WRITE",   [CMD_READ] = "READ",     [CMD_DELETE] = "DELETE",
+    [CMD_SHOW] = "SHOW",     [CMD_SCAN] = "SCAN",     [CMD_STATS] = "STATS",
+    [CMD_WAIT] = "WAIT",     [CMD_BACKUP] = "BACKUP", [CMD_HELP] = "HELP",
+    [CMD_EMPTY] = "EMPTY",   [CMD_INVALID] = "INVALID", [EOC] = "EOC"};
+
+static const char *lock_names[STAT_LOCKS] = {
+    [STAT_LOCK_QUEUE] = "queue",
+    [STAT_LOCK_STRIPE] = "stripe",
+    [STAT_LOCK_RESIZE] = "resize"};
+
+// The calling thread's counters, registered on first use. They outlive the
+// thread so its numbers still show up in the summary.
+static ThreadStats *thread_stats() {
+  if (local == NULL) {
+    local = calloc(1, sizeof(ThreadStats));
+    if (local == NULL) {
+      fprintf(stderr, "Failed to allocate statistics\n");
+      exit(1);
+    }
+    pthread_mutex_lock(&all_stats_lock);
+    local->next = all_stats;
+    all_stats = local;
+    pthread_mutex_unlock(&all_stats_lock);
+  }
+  return local;
+}
+
+static void add(atomic_uint_fast64_t *counter, uint64_t value) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+      memory_order_relaxed);
+}
+
+static size_t bucket_of(uint64_t ns) {
+  if (ns < HIST_LINEAR) {
+    return (size_t)ns;
+  }
+  unsigned msb = 63u - (unsigned)__builtin_clzll(ns);
+  size_t sub = (size_t)(ns >> (msb - 3)) & (HIST_SUB - 1);
+  return HIST_LINEAR + (msb - 4) * HIST_SUB + sub;
+}
+
+// Largest latency that falls in a bucket.
+static uint64_t bucket_limit(size_t bucket) {
+  if (bucket < HIST_LINEAR) {
+    return bucket;
+  }
+  unsigned msb = 4 + (unsigned)((bucket - HIST_LINEAR) / HIST_SUB);
+  uint64_t sub = (bucket - HIST_LINEAR) % HIST_SUB;
+  return ((HIST_SUB + sub + 1) << (msb - 3)) - 1;
+}
+
+uint64_t stats_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void stats_command(enum Command command, uint64_t ns) {
+  ThreadStats *stats = thread_stats();
+  add(&stats->latency[command][bucket_of(ns)], 1);
+  add(&stats->latency_sum[command], ns);
+}
+
+void stats_lock_wait(enum StatLock lock, uint64_t wait_ns) {
+  ThreadStats *stats = thread_stats();
+  add(&stats->acquired[lock], 1);
+  if (wait_ns > 0) {
+    add(&stats->contended[lock], 1);
+    add(&stats->wait_ns[lock], wait_ns);
+  }
+}
+
+void stats_hold_begin(enum StatLock lock) {
+  ThreadStats *stats = thread_stats();
+  size_t depth = stats->hold_depth[lock]++;
+  if (depth < HOLD_DEPTH) {
+    stats->hold_start[lock][depth] = stats_now();
+  }
+}
+
+// Holds that overlap without nesting end against each other's start, which
+// leaves their sum right.
+void stats_hold_end(enum StatLock lock) {
+  ThreadStats *stats = thread_stats();
+  if (stats->hold_depth[lock] == 0) {
+    return;
+  }
+  size_t depth = --stats->hold_depth[lock];
+  if (depth < HOLD_DEPTH) {
+    add(&stats->hold_ns[lock], stats_now() - stats->hold_start[lock][depth]);
+  }
+}
+
+// Latency under which a fraction of the samples fall, in microseconds.
+static double percentile(const uint64_t *hist, uint64_t count, double q) {
+  uint64_t rank = (uint64_t)((double)count * q);
+  uint64_t seen = 0;
+  for (size_t b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > rank) {
+      return (double)bucket_limit(b) / 1000.0;
+    }
+  }
+  return 0;
+}
+
+void stats_print(OutputBuffer *out, const size_t *lengths, size_t max) {
+  char line[256];
+  static uint64_t hist[HIST_BUCKETS];
+  static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+  pthread_mutex_lock(&print_lock);
+  pthread_mutex_lock(&all_stats_lock);
+  output_puts(out, "command        count    mean_us     p50_us     p99_us"
+                   "   p99.9_us     max_us\n");
+  for (int c = 0; c < NUM_COMMANDS; c++) {
+    uint64_t count = 0, sum = 0;
+    size_t last = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+      hist[b] = 0;
+      for (ThreadStats *s = all_stats; s != NULL; s = s->next) {
+        hist[b] += atomic_load_explicit(&s->latency[c][b], memory_order_relaxed);
+      }
+      count += hist[b];
+      if (hist[b] > 0) {
+        last = b;
+      }
+    }
+    if (count == 0) {
+      continue;
+    }
+    for (ThreadStats *s = all_stats; s != NULL; s = s->next) {
+      sum += atomic_load_explicit(&s->latency_sum[c], memory_order_relaxed);
+    }
+    snprintf(line, sizeof(line),
+             "%-8s %11llu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+             command_names[c], (unsigned long long)count,
+             (double)sum / (double)count / 1000.0,
+             percentile(hist, count, 0.5), percentile(hist, count, 0.99),
+             percentile(hist, count, 0.999),
+             (double)bucket_limit(last) / 1000.0);
+    output_puts(out, line);
+  }
+
+  output_puts(out, "lock        acquired   contended    wait_ms    hold_ms\n");
+  for (int l = 0; l < STAT_LOCKS; l++) {
+    uint64_t acquired = 0, contended = 0, wait_ns = 0, hold_ns = 0;
+    for (ThreadStats *s = all_stats; s != NULL; s = s->next) {
+      acquired += atomic_load_explicit(&s->acquired[l], memory_order_relaxed);
+      contended += atomic_load_explicit(&s->contended[l], memory_order_relaxed);
+      wait_ns += atomic_load_explicit(&s->wait_ns[l], memory_order_relaxed);
+      hold_ns += atomic_load_explicit(&s->hold_ns[l], memory_order_relaxed);
+    }
+    snprintf(line, sizeof(line), "%-8s %11llu %11llu %10.2f %10.2f\n",
+             lock_names[l], (unsigned long long)acquired,
+             (unsigned long long)contended, (double)wait_ns / 1e6,
+             (double)hold_ns / 1e6);
+    output_puts(out, line);
+  }
+  pthread_mutex_unlock(&all_stats_lock);
+  pthread_mutex_unlock(&print_lock);
+
+  output_puts(out, "chain    buckets\n");
+  for (size_t i = 0; i < max; i++) {
+    if (lengths[i] == 0) {
+      continue;
+    }
+    snprintf(line, sizeof(line), "%zu%-7s %zu\n", i,
+             i + 1 == max ? "+" : "", lengths[i]);
+    output_puts(out, line);
+  }
+}
+
+#endif // KVS_STATS
@@ -0,0 +1,80 @@
+#ifndef KVS_STATS_H
+#define KVS_STATS_H
+
+// Instrumentation of the hot paths, only built with -DKVS_STATS (make
+// STATS=1). Otherwise every macro below expands to nothing or to the plain
+// operation, so the instrumented code costs nothing.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "output.h"
+#include "parser.h"
+
+/// Locks whose waits and holds are counted.
+enum StatLock {
+  STAT_LOCK_QUEUE,  // the job queue's locker
+  STAT_LOCK_STRIPE, // a table stripe, shared or exclusive
+  STAT_LOCK_RESIZE, // the table's resize_lock
+  STAT_LOCKS
+};
+
+#ifdef KVS_STATS
+
+/// Monotonic clock in nanoseconds.
+uint64_t stats_now();
+
+/// Records how long a command took, parsing included.
+/// @param command Command that ran.
+/// @param ns Its latency in nanoseconds.
+void stats_command(enum Command command, uint64_t ns);
+
+/// Records a lock acquisition.
+/// @param lock Lock taken.
+/// @param wait_ns Time spent waiting for it, 0 if it was free.
+void stats_lock_wait(enum StatLock lock, uint64_t wait_ns);
+
+/// Starts timing a hold of a lock by the calling thread. Holds of the same
+/// type may nest, each timed from its own start.
+/// @param lock Lock just taken.
+void stats_hold_begin(enum StatLock lock);
+
+/// Ends the innermost hold of the type started by stats_hold_begin.
+/// @param lock Lock about to be released.
+void stats_hold_end(enum StatLock lock);
+
+/// Writes every thread's counters, summed, and the chain length histogram.
+/// @param out Buffer to write to.
+/// @param lengths lengths[i] buckets have chains of i nodes; the last entry
+/// also counts the longer ones.
+/// @param max Entries in lengths.
+void stats_print(OutputBuffer *out, const size_t *lengths, size_t max);
+
+#define STATS_TIME(var) uint64_t var = stats_now()
+#define STATS_COMMAND(command, start)                                          \
+  stats_command(command, stats_now() - (start))
+// Tries the lock first, so only acquisitions that had to wait are timed.
+#define STATS_LOCK(lock, trylock, take)                                        \
+  do {                                                                         \
+    if ((trylock) == 0) {                                                      \
+      stats_lock_wait(lock, 0);                                                \
+    } else {                                                                   \
+      uint64_t stats_start_ = stats_now();                                     \
+      take;                                                                    \
+      stats_lock_wait(lock, stats_now() - stats_start_ + 1);                   \
+    }                                                                          \
+  } while (0)
+#define STATS_HOLD_BEGIN(lock) stats_hold_begin(lock)
+#define STATS_HOLD_END(lock) stats_hold_end(lock)
+
+#else
+
+#define STATS_TIME(var)
+#define STATS_COMMAND(command, start)
+#define STATS_LOCK(lock, trylock, take) take
+#define STATS_HOLD_BEGIN(lock)
+#define STATS_HOLD_END(lock)
+
+#endif // KVS_STATS
+
+#endif // KVS_STATS_H
@@ -0,0 +1,509 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+// Records are gathered in a batch while the committer writes the previous
+// one, so every fdatasync covers all the commands that arrived meanwhile.
+struct batch {
+  char *data;
+  size_t used;
+  size_t capacity;
+};
+
+// Positions count the bytes appended since the log was opened, starting
+// from the size it had then. Only the committer touches the file, so it also
+// replaces it when wal_discard asks.
+static struct {
+  int opened;
+  int fd;
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  pthread_mutex_t lock;
+  pthread_cond_t pending;  // signalled when records are appended
+  pthread_cond_t durable;  // signalled when a batch is on disk
+  struct batch batches[2];
+  int current;             // batch receiving records
+  uint64_t appended_lsn;
+  uint64_t durable_lsn;
+  // First record of the batch a write failed on, 0 while the log works.
+  // The file can't be trusted after that, so every later record fails too.
+  uint64_t failed_lsn;
+  uint64_t appended_pos;   // end of the records appended
+  uint64_t written_pos;    // end of the records in the file
+  uint64_t base_pos;       // position of the first byte of the file
+  uint64_t cut_pos;        // records before it are to be dropped, 0 if none
+  int cut_failed;
+  uint64_t checkpoint_pos; // where the bytes wal_checkpoint_due counts start
+  unsigned int commit_delay_us;
+  int closing;
+  pthread_t committer;
+  // statistics
+  uint64_t syncs;
+  uint64_t records;
+  uint64_t sync_ns;
+} wal = {.fd = -1,
+         .lock = PTHREAD_MUTEX_INITIALIZER,
+         .pending = PTHREAD_COND_INITIALIZER,
+         .durable = PTHREAD_COND_INITIALIZER};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, buf, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    buf += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+// Stops the log after a write failed on the batch starting at lsn. wal.lock
+// is held.
+static void stop_log(uint64_t lsn, const char *what) {
+  if (wal.failed_lsn == 0) {
+    fprintf(stderr,
+            "Failed to %s log %s: %s. The log is stopped; WRITE and DELETE "
+            "are no longer durable and report failure from now on\n",
+            what, wal.path, strerror(errno));
+    wal.failed_lsn = lsn;
+  }
+}
+
+// Replaces the file with a copy of the bytes from cut on, so the records a
+// checkpoint holds are dropped. The file is only swapped once the copy is
+// on disk, so a crash leaves the old file or the new one.
+// @return 0 on success, 1 if the old file is still in use, 2 if the new one
+// is in use but may not survive a crash.
+static int rotate(uint64_t cut) {
+  size_t len = (size_t)(wal.written_pos - cut);
+  char *tail = malloc(len + 1);
+  if (!tail)
+    return 1;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t bytes_read =
+        pread(wal.fd, tail + done, len - done,
+              (off_t)(cut - wal.base_pos + done));
+    if (bytes_read <= 0) {
+      if (bytes_read < 0 && errno == EINTR)
+        continue;
+      free(tail);
+      return 1;
+    }
+    done += (size_t)bytes_read;
+  }
+
+  char tmp_path[MAX_JOB_FILE_NAME_SIZE + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", wal.path);
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                S_IRUSR | S_IWUSR);
+  int failed = fd == -1 || write_all(fd, tail, len) != 0 ||
+               fdatasync(fd) != 0 || rename(tmp_path, wal.path) != 0;
+  free(tail);
+  if (failed) {
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp_path);
+    }
+    return 1;
+  }
+  close(wal.fd);
+  wal.fd = fd;
+  return sync_parent(wal.path) != 0 ? 2 : 0;
+}
+
+// Whether wal_discard asked for records that are all in the file by now.
+// wal.lock is held.
+static int cut_due() {
+  return wal.cut_pos > wal.base_pos && wal.cut_pos <= wal.written_pos &&
+         wal.failed_lsn == 0;
+}
+
+static void *committer(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&wal.lock);
+  while (1) {
+    while (wal.appended_lsn == wal.durable_lsn && !cut_due() &&
+           !wal.closing) {
+      pthread_cond_wait(&wal.pending, &wal.lock);
+    }
+    if (cut_due()) {
+      uint64_t cut = wal.cut_pos;
+      pthread_mutex_unlock(&wal.lock);
+      int result = rotate(cut);
+      pthread_mutex_lock(&wal.lock);
+      if (result != 1) {
+        wal.base_pos = cut;
+      }
+      if (result == 2) {
+        // records appended from now on may be lost with the new file
+        stop_log(wal.appended_lsn + 1, "sync the directory of");
+      }
+      wal.cut_failed = result == 1;
+      wal.cut_pos = 0;
+      pthread_cond_broadcast(&wal.durable);
+      continue;
+    }
+    if (wal.appended_lsn == wal.durable_lsn) {
+      break; // closing and nothing left
+    }
+
+    if (wal.commit_delay_us > 0 && !wal.closing) {
+      // latency budget: let more commands join this batch
+      pthread_mutex_unlock(&wal.lock);
+      struct timespec delay = {wal.commit_delay_us / 1000000,
+                               (long)(wal.commit_delay_us % 1000000) * 1000};
+      nanosleep(&delay, NULL);
+      pthread_mutex_lock(&wal.lock);
+    }
+
+    struct batch *batch = &wal.batches[wal.current];
+    wal.current = 1 - wal.current;
+    uint64_t first = wal.durable_lsn + 1;
+    uint64_t lsn = wal.appended_lsn;
+    uint64_t records = lsn - wal.durable_lsn;
+    int stopped = wal.failed_lsn != 0;
+    pthread_mutex_unlock(&wal.lock);
+
+    // once stopped, batches are dropped so their waiters still get an answer
+    uint64_t start = now_ns();
+    int failed = !stopped && write_all(wal.fd, batch->data, batch->used) != 0;
+    int sync_failed = !stopped && !failed && fdatasync(wal.fd) != 0;
+    uint64_t elapsed = now_ns() - start;
+    size_t used = batch->used;
+    batch->used = 0;
+
+    pthread_mutex_lock(&wal.lock);
+    if (failed || sync_failed) {
+      stop_log(first, failed ? "write" : "sync");
+    } else if (!stopped) {
+      wal.written_pos += used;
+      wal.syncs++;
+      wal.records += records;
+      wal.sync_ns += elapsed;
+    }
+    wal.durable_lsn = lsn;
+    pthread_cond_broadcast(&wal.durable);
+  }
+  pthread_mutex_unlock(&wal.lock);
+  return NULL;
+}
+
+int wal_open(const char *path, unsigned int commit_delay_us) {
+  wal.fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+  struct stat st;
+  if (wal.fd == -1 || fstat(wal.fd, &st) == -1) {
+    fprintf(stderr, "Failed to open log %s: %s\n", path, strerror(errno));
+    if (wal.fd != -1) {
+      close(wal.fd);
+      wal.fd = -1;
+    }
+    return 1;
+  }
+  snprintf(wal.path, sizeof(wal.path), "%s", path);
+  wal.base_pos = 0;
+  wal.written_pos = wal.appended_pos = wal.checkpoint_pos =
+      (uint64_t)st.st_size;
+  wal.commit_delay_us = commit_delay_us;
+  if (pthread_create(&wal.committer, NULL, committer, NULL) != 0) {
+    close(wal.fd);
+    wal.fd = -1;
+    return 1;
+  }
+  wal.opened = 1;
+  return 0;
+}
+
+// Appends bytes to the batch being filled. wal.lock is held.
+static int put(struct batch *batch, const void *buf, size_t len) {
+  if (batch->used + len > batch->capacity) {
+    size_t capacity = batch->capacity ? batch->capacity : 65536;
+    while (batch->used + len > capacity) {
+      capacity *= 2;
+    }
+    char *data = realloc(batch->data, capacity);
+    if (!data)
+      return 1;
+    batch->data = data;
+    batch->capacity = capacity;
+  }
+  memcpy(batch->data + batch->used, buf, len);
+  batch->used += len;
+  return 0;
+}
+
+static int put_string(struct batch *batch, const char *str) {
+  unsigned char len = (unsigned char)strnlen(str, MAX_STRING_SIZE - 1);
+  return put(batch, &len, 1) || put(batch, str, len);
+}
+
+// Appends a record; types gives the type of each pair of a WAL_BATCH and is
+// NULL otherwise.
+static uint64_t append_record(char type, size_t num_pairs, const char *types,
+                              char keys[][MAX_STRING_SIZE],
+                              char values[][MAX_STRING_SIZE]) {
+  if (!wal.opened) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&wal.lock);
+  if (wal.failed_lsn != 0) {
+    pthread_mutex_unlock(&wal.lock);
+    return WAL_NOT_LOGGED;
+  }
+  struct batch *batch = &wal.batches[wal.current];
+  size_t start = batch->used;
+  unsigned char header[3] = {(unsigned char)type, (unsigned char)num_pairs,
+                             (unsigned char)(num_pairs >> 8)};
+  int failed = put(batch, header, sizeof(header));
+  for (size_t i = 0; i < num_pairs && !failed; i++) {
+    char pair_type = types != NULL ? types[i] : type;
+    failed = (types != NULL && put(batch, &pair_type, 1)) ||
+             put_string(batch, keys[i]) ||
+             (pair_type == WAL_WRITE && put_string(batch, values[i]));
+  }
+  if (!failed) {
+    uint32_t crc = crc32_update(0, batch->data + start, batch->used - start);
+    unsigned char bytes[4];
+    for (int i = 0; i < 4; i++) {
+      bytes[i] = (unsigned char)(crc >> (8 * i));
+    }
+    failed = put(batch, bytes, sizeof(bytes));
+  }
+  if (failed) {
+    // only this command is lost; the batch is left as it was
+    batch->used = start;
+    pthread_mutex_unlock(&wal.lock);
+    fprintf(stderr, "Failed to log command: no memory\n");
+    return WAL_NOT_LOGGED;
+  }
+
+  uint64_t lsn = ++wal.appended_lsn;
+  wal.appended_pos += batch->used - start;
+  pthread_cond_signal(&wal.pending);
+  pthread_mutex_unlock(&wal.lock);
+  return lsn;
+}
+
+uint64_t wal_append(char type, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE]) {
+  return append_record(type, num_pairs, NULL, keys, values);
+}
+
+uint64_t wal_append_batch(size_t num_pairs, const char *types,
+                          char keys[][MAX_STRING_SIZE],
+                          char values[][MAX_STRING_SIZE]) {
+  return append_record(WAL_BATCH, num_pairs, types, keys, values);
+}
+
+int wal_wait(uint64_t lsn) {
+  if (lsn == WAL_NOT_LOGGED) {
+    return 1;
+  }
+  pthread_mutex_lock(&wal.lock);
+  while (wal.durable_lsn < lsn) {
+    pthread_cond_wait(&wal.durable, &wal.lock);
+  }
+  int failed = wal.failed_lsn != 0 && lsn >= wal.failed_lsn;
+  pthread_mutex_unlock(&wal.lock);
+  return failed;
+}
+
+int wal_checkpoint_due() {
+  if (!wal.opened) {
+    return 0;
+  }
+  pthread_mutex_lock(&wal.lock);
+  int due = wal.failed_lsn == 0 &&
+            wal.appended_pos - wal.checkpoint_pos >= WAL_CHECKPOINT_BYTES;
+  pthread_mutex_unlock(&wal.lock);
+  return due;
+}
+
+uint64_t wal_mark() {
+  pthread_mutex_lock(&wal.lock);
+  uint64_t pos = wal.appended_pos;
+  pthread_mutex_unlock(&wal.lock);
+  return pos;
+}
+
+int wal_discard(uint64_t mark) {
+  if (!wal.opened) {
+    return 0;
+  }
+  pthread_mutex_lock(&wal.lock);
+  // counted from the mark even if this fails, so a failing discard isn't
+  // retried on every command
+  wal.checkpoint_pos = mark;
+  wal.cut_pos = mark;
+  wal.cut_failed = 0;
+  pthread_cond_signal(&wal.pending);
+  while (wal.base_pos < mark && !wal.cut_failed && wal.failed_lsn == 0) {
+    pthread_cond_wait(&wal.durable, &wal.lock);
+  }
+  int failed = wal.base_pos < mark;
+  wal.cut_pos = 0;
+  pthread_mutex_unlock(&wal.lock);
+  return failed;
+}
+
+void wal_close() {
+  if (!wal.opened) {
+    return;
+  }
+  pthread_mutex_lock(&wal.lock);
+  wal.closing = 1;
+  pthread_cond_signal(&wal.pending);
+  pthread_mutex_unlock(&wal.lock);
+  pthread_join(wal.committer, NULL);
+
+  if (wal.syncs > 0) {
+    fprintf(stderr,
+            "WAL: %llu records in %llu syncs (%.1f per sync), "
+            "%.1f us per sync, %.2f us per record\n",
+            (unsigned long long)wal.records, (unsigned long long)wal.syncs,
+            (double)wal.records / (double)wal.syncs,
+            (double)wal.sync_ns / 1000.0 / (double)wal.syncs,
+            (double)wal.sync_ns / 1000.0 / (double)wal.records);
+  }
+  close(wal.fd);
+  wal.fd = -1;
+  wal.opened = 0;
+  for (int i = 0; i < 2; i++) {
+    free(wal.batches[i].data);
+    wal.batches[i].data = NULL;
+    wal.batches[i].used = wal.batches[i].capacity = 0;
+  }
+}
+
+// Reads a length prefixed string of a record into dest.
+// @return Bytes consumed, 0 if the record ends before the string does.
+static size_t get_string(const unsigned char *buf, size_t avail, char *dest) {
+  if (avail < 1 || buf[0] >= MAX_STRING_SIZE || avail < 1 + (size_t)buf[0]) {
+    return 0;
+  }
+  memcpy(dest, buf + 1, buf[0]);
+  dest[buf[0]] = '\0';
+  return 1 + (size_t)buf[0];
+}
+
+// Parses and checks the record at data. Keys and values are only applied
+// when apply is set, after the whole record has been checked.
+// @return Size of the record, 0 if it is incomplete or corrupt.
+static size_t replay_record(const unsigned char *data, size_t avail,
+                            HashTable *ht, int apply) {
+  if (avail < 3 ||
+      (data[0] != WAL_WRITE && data[0] != WAL_DELETE && data[0] != WAL_BATCH)) {
+    return 0;
+  }
+  char type = (char)data[0];
+  size_t num_pairs = (size_t)data[1] | (size_t)data[2] << 8;
+  size_t pos = 3;
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    char pair_type = type;
+    if (type == WAL_BATCH) {
+      if (pos == avail || (data[pos] != WAL_WRITE && data[pos] != WAL_DELETE))
+        return 0;
+      pair_type = (char)data[pos++];
+    }
+    size_t used = get_string(data + pos, avail - pos, key);
+    if (used == 0)
+      return 0;
+    pos += used;
+    if (pair_type == WAL_WRITE) {
+      used = get_string(data + pos, avail - pos, value);
+      if (used == 0)
+        return 0;
+      pos += used;
+    }
+    if (apply) {
+      lock_key(ht, key, 1);
+      if (pair_type == WAL_WRITE) {
+        write_pair(ht, key, value);
+      } else {
+        delete_pair(ht, key);
+      }
+      unlock_key(ht, key);
+    }
+  }
+
+  if (avail - pos < 4) {
+    return 0;
+  }
+  uint32_t crc = (uint32_t)data[pos] | (uint32_t)data[pos + 1] << 8 |
+                 (uint32_t)data[pos + 2] << 16 | (uint32_t)data[pos + 3] << 24;
+  if (crc32_update(0, data, pos) != crc) {
+    return 0;
+  }
+  return pos + 4;
+}
+
+int wal_replay(const char *path, HashTable *ht) {
+  int fd = open(path, O_RDWR);
+  if (fd == -1) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  unsigned char *data = malloc(size + 1);
+  size_t done = 0;
+  while (data != NULL && done < size) {
+    ssize_t bytes_read = read(fd, data + done, size - done);
+    if (bytes_read <= 0) {
+      if (bytes_read < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+    done += (size_t)bytes_read;
+  }
+  if (data == NULL) {
+    close(fd);
+    return 1;
+  }
+
+  size_t pos = 0, records = 0;
+  size_t len;
+  while ((len = replay_record(data + pos, done - pos, ht, 0)) > 0) {
+    replay_record(data + pos, len, ht, 1);
+    pos += len;
+    records++;
+  }
+  free(data);
+
+  if (pos < size) {
+    fprintf(stderr, "Discarding %zu bytes of torn log after %zu records\n",
+            size - pos, records);
+    if (ftruncate(fd, (off_t)pos) != 0) {
+      close(fd);
+      return 1;
+    }
+  }
+  close(fd);
+  return 0;
+}
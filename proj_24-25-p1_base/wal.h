@@ -0,0 +1,93 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "kvs.h"
+
+// Record layout, integers little endian:
+//   u8 type ('W', 'D' or 'B'), u16 number of pairs,
+//   per pair: for 'B', u8 'W' or 'D' for the pair alone; then u8 key length,
+//   key and, for 'W', u8 value length, value,
+//   u32 CRC-32 of the record.
+// One record holds a whole command, or a whole flush of a write batch with
+// its writes and deletes in the order they were applied, so a replay applies
+// all of it or none.
+#define WAL_WRITE 'W'
+#define WAL_DELETE 'D'
+#define WAL_BATCH 'B'
+
+// Bytes logged after which the running program folds the log into a
+// checkpoint and drops what the checkpoint holds, so a long run doesn't grow
+// it without bound.
+#define WAL_CHECKPOINT_BYTES (64 * 1024 * 1024)
+// Returned instead of a sequence number for a record that didn't make it
+// into the log.
+#define WAL_NOT_LOGGED UINT64_MAX
+
+/// Replays a log into a table nobody else is using yet. A torn or corrupt
+/// tail, left by a crash in the middle of a write, is cut off.
+/// @param path Path of the log. A missing log is an empty one.
+/// @param ht Table to apply the records to.
+/// @return 0 on success, 1 if the log can't be read.
+int wal_replay(const char *path, HashTable *ht);
+
+/// Opens the log for appending and starts the thread that commits it.
+/// @param path Path of the log.
+/// @param commit_delay_us Time the committer waits for more records before
+/// each write and fdatasync, trading latency for bigger batches.
+/// @return 0 on success, 1 otherwise.
+int wal_open(const char *path, unsigned int commit_delay_us);
+
+/// Appends a WRITE or DELETE command to the log. Call it while the keys'
+/// stripes are held, so the log order matches the order the table saw.
+/// @param type WAL_WRITE or WAL_DELETE.
+/// @param num_pairs Number of keys.
+/// @param keys Keys of the command.
+/// @param values Values of the command, NULL for WAL_DELETE.
+/// @return Sequence number to give to wal_wait, 0 if the log is not open,
+/// WAL_NOT_LOGGED if there was no memory for the record or the log stopped.
+uint64_t wal_append(char type, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE]);
+
+/// Appends a flush of a write batch to the log as one record. Call it while
+/// the keys' stripes are held.
+/// @param num_pairs Number of writes and deletes.
+/// @param types WAL_WRITE or WAL_DELETE for each pair, applied in order.
+/// @param keys Keys of the pairs.
+/// @param values Values of the pairs; ignored for deletes.
+/// @return As for wal_append.
+uint64_t wal_append_batch(size_t num_pairs, const char *types,
+                          char keys[][MAX_STRING_SIZE],
+                          char values[][MAX_STRING_SIZE]);
+
+/// Blocks until a record is on stable storage. A failed write or fdatasync
+/// leaves the file in a state that can't be trusted, so it stops the log:
+/// the records of that batch and every later one fail.
+/// @param lsn Sequence number returned by wal_append.
+/// @return 0 once durable, 1 if the record was not logged.
+int wal_wait(uint64_t lsn);
+
+/// Tells whether WAL_CHECKPOINT_BYTES were logged since the last checkpoint.
+/// @return 1 if a checkpoint is due, 0 otherwise.
+int wal_checkpoint_due();
+
+/// Returns the end of the records appended so far. Take it while no record
+/// can be appended, with the table locked, so it matches the table.
+/// @return Position to give to wal_discard.
+uint64_t wal_mark();
+
+/// Drops the records before a mark, once a checkpoint holds them. The
+/// committer copies the records after the mark to a new file that replaces
+/// the log; appending goes on meanwhile.
+/// @param mark Position returned by wal_mark.
+/// @return 0 on success, 1 if the log is kept whole.
+int wal_discard(uint64_t mark);
+
+/// Commits what is pending, stops the committer, prints its statistics and
+/// closes the log.
+void wal_close();
+
+#endif // KVS_WAL_H